@@ -1,27 +1,200 @@
 #include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <round.h>
 #include "filesys/cache.h"
 #include "filesys/filesys.h"
+#include "filesys/inode.h"
 #include "threads/malloc.h"
+#include "threads/palloc.h"
 #include "threads/thread.h"
+#include "threads/vaddr.h"
 #include "devices/timer.h"
 
 #define FLUSH_FREQUENCY 5
+#define DIRTY_EXPIRE_DEFAULT (2 * TIMER_FREQ) /* Ticks a slot may stay
+						 dirty */
+#define DIRTY_RATIO_DEFAULT 50	/* Percent of slots dirty before
+				   writers are throttled */
+#define FLUSH_BATCH 64		/* Slots sorted and written per round */
+#define FLUSH_MERGE_MAX 64	/* Sectors written per merged request */
+#define SLOTS_PER_PAGE (PGSIZE / CACHE_BLOCK_SIZE)
+#define CACHE_MIN_SIZE ROUND_UP (4, SLOTS_PER_PAGE) /* Slots */
+#define CACHE_MAX_SIZE (4096 / CACHE_BLOCK_SECTORS) /* Slots; 2 MB of
+						       data */
+#define CACHE_LOW_PAGES 32	/* Give pages back below this many free
+				   kernel pages */
+#define META_RESERVE_DEFAULT 25	/* Percent of slots kept for metadata */
+#define GHOST_MAX (CACHE_MAX_SIZE / 2) /* Capacity of the 2Q ghost ring */
+#define VICTIM_SCAN_MAX 8	/* Queued candidates looked at for a
+				   clean victim */
 thread_func write_behind_daemon;
 
+/* A page worth of cache slots.  Their data blocks are packed in
+   one page, and their metadata is kept together here, apart from
+   the data. */
+struct cache_page
+{
+  char *data;				/* Data blocks of SLOTS */
+  struct cache_entry slots[SLOTS_PER_PAGE];
+};
+
+/* Buffer Cache: the pages of cache slots.  Slot I is slot
+   I % SLOTS_PER_PAGE of page I / SLOTS_PER_PAGE; only the first
+   cache_size slots are in use. */
+static struct cache_page *cache_pages[CACHE_MAX_SIZE / SLOTS_PER_PAGE];
+
+/* Number of slots in the cache, a multiple of SLOTS_PER_PAGE */
+static size_t cache_size;
+
+/* Number of slots the cache is meant to have.  The write-behind
+   daemon shrinks the cache below it when kernel memory runs low
+   and grows it back afterwards. */
+static size_t cache_target = BUFFER_CACHE_SIZE;
+
+/* The write-behind daemon, which throttled writers wait for and
+   which must therefore never be throttled itself */
+static struct thread *write_behind_thread;
+
+/* Serializes changes to cache_size */
+static struct lock resize_lock;
+
+/* Index of the cache entries in use, keyed by sector number */
+static struct hash cache_index;
+
+/* Dirty slots, in the order they were first dirtied.  A slot is on
+   it exactly while it has dirty sectors: a flush takes the dirty
+   sectors of a slot off it before writing them. */
+static struct list dirty_list;
+
+/* Number of dirty slots, on dirty_list */
+static size_t dirty_cnt;
+
+/* Signaled when dirty_cnt drops to the dirty ratio, for throttled
+   writers */
+static struct condition dirty_below;
+
+/* Dirty slots older than this many ticks are written back by the
+   write-behind daemon */
+static int64_t dirty_expire = DIRTY_EXPIRE_DEFAULT;
+
+/* Writers are throttled while more than this percentage of the
+   slots is dirty.  The write-behind daemon flushes everything once
+   half of it is reached. */
+static int dirty_ratio = DIRTY_RATIO_DEFAULT;
+
+/* Serializes flushes, so that a flush returns only once every
+   slot dirty when it started is on disk, even if another flush had
+   already taken some of them off dirty_list */
+static struct lock flush_lock;
+
+/* Gathers the dirty sectors of consecutive slots, so that a run
+   of them crossing slot boundaries is written with one device
+   request.  Protected by flush_lock. */
+static uint8_t flush_buffer[FLUSH_MERGE_MAX * BLOCK_SECTOR_SIZE];
+
+/* Statistics, protected by cache_lock.  The flush counters are
+   protected by flush_lock instead. */
+static struct cache_stats stats;
+
+/* Percentage of the slots that data sectors may not take from
+   metadata */
+static int meta_reserve = META_RESERVE_DEFAULT;
+
+/* Number of slots holding a sector of each enum cache_class */
+static size_t class_cnt[2];
+
+/* Replacement policy in use, and the names it is selected by */
+static enum cache_policy cache_policy = CACHE_POLICY_2Q;
+static const char *policy_names[] = { "clock", "lru", "2q" };
+
+/* Next slot examined by the clock when evicting */
+static size_t clock_hand;
+
+/* Slots on each enum cache_queue, most recently used first.  Every
+   slot is on one of them, whatever the policy, so that the policy
+   may be switched at any time.  Under 2Q, CACHE_Q_IN is the FIFO
+   of slots used once (A1in), kept to a quarter of the cache, and
+   CACHE_Q_MAIN the LRU of slots used again (Am). */
+static struct list cache_queues[3];
+
+/* Number of slots on cache_queues[CACHE_Q_IN] */
+static size_t in_cnt;
+
+/* 2Q's ghost queue (A1out): the last cache_size / 2 sectors
+   evicted from CACHE_Q_IN, oldest first, in a ring.  A miss on one
+   of them shows reuse, so the sector goes straight to CACHE_Q_MAIN.
+   Entries found are overwritten with EMPTY. */
+static block_sector_t ghosts[GHOST_MAX];
+static size_t ghost_head, ghost_cnt;
+
+/* Signaled when a slot is unpinned, for evictors waiting on a
+   cache where every slot is pinned and for cache_remove_page() */
+static struct condition cache_unpinned;
+
+static hash_hash_func cache_hash;
+static hash_less_func cache_less;
+static struct cache_entry *cache_lookup (block_sector_t);
+static void cache_index_remove (struct cache_entry *);
+static void cache_entry_init (struct cache_entry *);
+static void cache_entry_drop (struct cache_entry *);
+static void cache_rw_acquire (struct cache_entry *, enum cache_mode);
+static void cache_rw_release (struct cache_entry *, enum cache_mode);
+static void cache_unpin (struct cache_entry *);
+static void cache_flush_dirty (int64_t, block_sector_t);
+static bool cache_owned_by (struct cache_entry *, block_sector_t);
+static size_t cache_write_run (struct cache_entry **, size_t);
+static size_t cache_write_back (struct cache_entry *, unsigned);
+static size_t cache_fill (struct cache_entry *, block_sector_t, size_t,
+			  bool);
+static unsigned cache_range_mask (block_sector_t, size_t);
+static size_t cache_count_bits (unsigned);
+static void cache_mark_clean (struct cache_entry *);
+static void cache_set_class (struct cache_entry *, unsigned,
+			     enum cache_class);
+static bool cache_dirty_over (int);
+static int cache_sector_cmp (const void *, const void *);
+static struct cache_entry *evict_cache_entry (enum cache_class);
+static bool cache_victim_ok (struct cache_entry *, bool);
+static struct cache_entry *cache_clock_victim (bool);
+static struct cache_entry *cache_queue_victim (bool);
+static struct cache_entry *cache_queue_last (enum cache_queue, bool);
+static void cache_queue_insert (struct cache_entry *);
+static void cache_queue_move (struct cache_entry *, enum cache_queue);
+static void cache_queue_remove (struct cache_entry *);
+static void cache_ghost_add (block_sector_t);
+static bool cache_ghost_remove (block_sector_t);
+static struct cache_entry *cache_load (block_sector_t, size_t,
+				       enum cache_mode, enum cache_class,
+				       bool);
+static struct cache_entry *cache_slot (size_t);
+static bool cache_add_page (void);
+static void cache_remove_page (void);
+static size_t cache_resize (size_t);
+static size_t cache_size_clamp (size_t);
+
 void
 buffer_cache_init ()
 {
   lock_init (&cache_lock);
-  list_init (&buffer_cache);
+  cond_init (&cache_unpinned);
+  list_init (&dirty_list);
+  cond_init (&dirty_below);
+  dirty_cnt = 0;
+  lock_init (&flush_lock);
+  lock_init (&resize_lock);
+  list_init (&cache_queues[CACHE_Q_FREE]);
+  list_init (&cache_queues[CACHE_Q_IN]);
+  list_init (&cache_queues[CACHE_Q_MAIN]);
+  in_cnt = 0;
+  class_cnt[CACHE_DATA] = class_cnt[CACHE_META] = 0;
+  ghost_head = ghost_cnt = 0;
+  hash_init (&cache_index, cache_hash, cache_less, NULL);
 
-  int i;
-  lock_acquire (&cache_lock);
-  for (i = 0; i < BUFFER_CACHE_SIZE; i++)
-   {
-     struct cache_entry *entry = allocate_cache_entry ();
-     list_push_front (&buffer_cache, &entry->elem);
-   }  
-  lock_release (&cache_lock);
+  cache_size = 0;
+  clock_hand = 0;
+  if (cache_resize (cache_target) < CACHE_MIN_SIZE)
+    PANIC ("Cannot allocate buffer cache!");
 
   /* Create the write_behind daemon */
   tid_t daemon_tid = thread_create ("write_behind_daemon", PRI_MAX - 1,
@@ -30,177 +203,1254 @@ buffer_cache_init ()
     PANIC ("Cannot create write-behind daemon!");
 }
 
+/* Sets the number of sectors the cache is created with, rounded
+   up to whole blocks.  Must be called before buffer_cache_init();
+   used for the -cache option. */
+void
+cache_set_size (size_t sectors)
+{
+  cache_target = cache_size_clamp (DIV_ROUND_UP (sectors,
+						 CACHE_BLOCK_SECTORS));
+}
+
+/* Selects the replacement policy named NAME: "clock", "lru" or
+   "2q".  Returns false if there is no such policy.  Used for the
+   -cache-policy option. */
+bool
+cache_set_policy (const char *name)
+{
+  size_t i;
+
+  for (i = 0; name != NULL && i < sizeof policy_names / sizeof *policy_names;
+       i++)
+    if (!strcmp (name, policy_names[i]))
+     {
+       cache_policy = i;
+       return true;
+     }
+  return false;
+}
+
+/* Reserves PERCENT percent of the slots for metadata: data
+   sectors are not brought in at the expense of metadata beyond
+   that share.  Used for the -cache-meta option. */
+void
+cache_set_meta_reserve (int percent)
+{
+  if (percent < 0)
+    percent = 0;
+  if (percent > 100)
+    percent = 100;
+  meta_reserve = percent;
+}
+
+/* Grows or shrinks the buffer cache to SLOTS slots, rounded up to
+   whole pages and kept between CACHE_MIN_SIZE and CACHE_MAX_SIZE.
+   Shrinking writes back and drops the slots given up, waiting for
+   the pinned ones.  Growing stops early if memory runs out.
+   Returns the new number of slots. */
+static size_t
+cache_resize (size_t slots)
+{
+  size_t size;
+
+  slots = cache_size_clamp (slots);
+  lock_acquire (&resize_lock);
+  cache_target = slots;
+  lock_acquire (&cache_lock);
+  while (cache_size < slots && cache_add_page ())
+    continue;
+  while (cache_size > slots)
+    cache_remove_page ();
+  size = cache_size;
+  lock_release (&cache_lock);
+  lock_release (&resize_lock);
+  return size;
+}
+
+/* Returns SLOTS rounded up to whole pages and kept between
+   CACHE_MIN_SIZE and CACHE_MAX_SIZE */
+static size_t
+cache_size_clamp (size_t slots)
+{
+  slots = ROUND_UP (slots, SLOTS_PER_PAGE);
+  if (slots < CACHE_MIN_SIZE)
+    slots = CACHE_MIN_SIZE;
+  if (slots > CACHE_MAX_SIZE)
+    slots = CACHE_MAX_SIZE;
+  return slots;
+}
+
+/* Adds a page of empty slots at the end of the cache.  Returns
+   false if out of memory.  Must be called with cache_lock held. */
+static bool
+cache_add_page (void)
+{
+  struct cache_page *page;
+  int i;
+
+  ASSERT (lock_held_by_current_thread (&cache_lock));
+  ASSERT (cache_size < CACHE_MAX_SIZE);
+
+  page = malloc (sizeof *page);
+  if (page == NULL)
+    return false;
+  page->data = palloc_get_page (PAL_ZERO);
+  if (page->data == NULL)
+   {
+     free (page);
+     return false;
+   }
+
+  for (i = 0; i < SLOTS_PER_PAGE; i++)
+   {
+     page->slots[i].data = page->data + i * CACHE_BLOCK_SIZE;
+     cond_init (&page->slots[i].rw_changed);
+     cache_entry_init (&page->slots[i]);
+     page->slots[i].queue = CACHE_Q_FREE;
+     list_push_back (&cache_queues[CACHE_Q_FREE],
+		     &page->slots[i].queue_elem);
+   }
+  cache_pages[cache_size / SLOTS_PER_PAGE] = page;
+  cache_size += SLOTS_PER_PAGE;
+  return true;
+}
+
+/* Removes the last page of slots from the cache, writing back its
+   dirty slots.  The slots are taken out of the clock's reach first,
+   then each is dropped once unpinned.
+   Must be called with cache_lock held. */
+static void
+cache_remove_page (void)
+{
+  struct cache_page *page;
+  struct cache_entry *entry;
+  int i;
+
+  ASSERT (lock_held_by_current_thread (&cache_lock));
+  ASSERT (cache_size > CACHE_MIN_SIZE);
+
+  cache_size -= SLOTS_PER_PAGE;
+  page = cache_pages[cache_size / SLOTS_PER_PAGE];
+  if (clock_hand >= cache_size)
+    clock_hand = 0;
+
+  for (i = 0; i < SLOTS_PER_PAGE; i++)
+   {
+     entry = &page->slots[i];
+     while (entry->open_count > 0)
+       cond_wait (&cache_unpinned, &cache_lock);
+     if (entry->dirty)
+      {
+        cache_write_back (entry, entry->dirty);
+        list_remove (&entry->dirty_elem);
+        cache_mark_clean (entry);
+      }
+     if (entry->sector != EMPTY)
+       cache_entry_drop (entry);
+     cache_queue_remove (entry);
+   }
+
+  cache_pages[cache_size / SLOTS_PER_PAGE] = NULL;
+  palloc_free_page (page->data);
+  free (page);
+}
+
+/* Returns slot I of the buffer cache */
+static struct cache_entry *
+cache_slot (size_t i)
+{
+  return &cache_pages[i / SLOTS_PER_PAGE]->slots[i % SLOTS_PER_PAGE];
+}
+
 /* Function to write all dirty entries in buffer_cache to disk.
    Run when filesys_done() is called (during shutdown).
    Also run by the write behind daemon periodically to flush
-   contents to disk */
+   contents to disk. */
 void
 buffer_cache_flush ()
 {
-  struct list_elem *e;
+  cache_flush_dirty (timer_ticks (), EMPTY);
+}
+
+/* Writes back the slots holding dirty sectors written for the inode
+   at sector INUMBER, and returns once they are on disk.  Used by
+   fsync() and fdatasync(). */
+void
+cache_flush_owner (block_sector_t inumber)
+{
+  cache_flush_dirty (timer_ticks (), inumber);
+}
+
+/* Writes back the slots dirtied at or before tick CUTOFF, only
+   those with dirty sectors owned by the inode at sector OWNER
+   unless it is EMPTY.
+   The slots are written in ascending sector order, a run of
+   adjacent blocks at a time, and only the slots of the current
+   run are held, never cache_lock, while the disk is busy. */
+static void
+cache_flush_dirty (int64_t cutoff, block_sector_t owner)
+{
+  struct cache_entry *batch[FLUSH_BATCH];
   struct cache_entry *entry;
+  struct list_elem *e;
+  size_t cnt, written = 0, i, j;
+  int64_t start;
+
+  lock_acquire (&flush_lock);
+  start = timer_ticks ();
+  do
+    {
+      /* Take the old enough slots off the front of dirty_list,
+         pinning them so that they stay put until written.  Their
+         dirty sectors are now the flush's to write. */
+      cnt = 0;
+      lock_acquire (&cache_lock);
+      e = list_begin (&dirty_list);
+      while (cnt < FLUSH_BATCH && e != list_end (&dirty_list))
+        {
+          entry = list_entry (e, struct cache_entry, dirty_elem);
+          if (entry->dirty_since > cutoff)
+            break;
+          e = list_next (e);
+          if (owner != EMPTY && !cache_owned_by (entry, owner))
+            continue;
+          entry->flush_mask = entry->dirty;
+          list_remove (&entry->dirty_elem);
+          cache_mark_clean (entry);
+          entry->open_count++;
+          batch[cnt++] = entry;
+        }
+      lock_release (&cache_lock);
+
+      qsort (batch, cnt, sizeof *batch, cache_sector_cmp);
+      for (i = 0; i < cnt; i = j)
+        {
+          for (j = i + 1;
+	       j < cnt && (batch[j]->sector
+			   == batch[j - 1]->sector + CACHE_BLOCK_SECTORS);
+	       j++)
+            continue;
+          written += cache_write_run (batch + i, j - i);
+        }
+    }
+  while (cnt == FLUSH_BATCH);
+
+  if (written > 0)
+    {
+      stats.flushes++;
+      stats.flush_writes += written;
+      stats.flush_ticks += timer_elapsed (start);
+    }
+  lock_release (&flush_lock);
+}
+
+/* Writes the sectors taken for writing from the CNT pinned slots
+   in RUN, which hold consecutive blocks, back to disk and unpins
+   them.  Each slot is held shared while it is written, so writers
+   finish their update first and readers are not held up.  Sectors
+   invalidated meanwhile are skipped.  Consecutive dirty sectors are
+   gathered in flush_buffer and written with one device request,
+   across slot boundaries, up to FLUSH_MERGE_MAX at a time.  Must be
+   called with flush_lock held.  Returns the number of sectors
+   written. */
+static size_t
+cache_write_run (struct cache_entry **run, size_t cnt)
+{
+  unsigned dirty[FLUSH_BATCH];
+  block_sector_t first = 0;
+  size_t written = 0, merged = 0, i, j, k;
+
+  lock_acquire (&cache_lock);
+  for (i = 0; i < cnt; i++)
+    {
+      cache_rw_acquire (run[i], CACHE_READ);
+      dirty[i] = run[i]->flush_mask & run[i]->valid;
+    }
+  lock_release (&cache_lock);
+
+  for (i = 0; i < cnt; i++)
+    for (j = 0; j < CACHE_BLOCK_SECTORS; j = k)
+      {
+        if (!(dirty[i] & (1u << j)))
+          {
+            k = j + 1;
+            continue;
+          }
+        for (k = j + 1; k < CACHE_BLOCK_SECTORS && (dirty[i] & (1u << k));
+             k++)
+          continue;
+
+        /* Sectors J to K - 1 of slot I extend the merged request, or
+           start a new one. */
+        if (merged > 0 && (first + merged != run[i]->sector + j
+                           || merged + (k - j) > FLUSH_MERGE_MAX))
+          {
+            block_write_multiple (fs_device, first, flush_buffer, merged);
+            merged = 0;
+          }
+        if (merged == 0)
+          first = run[i]->sector + j;
+        memcpy (flush_buffer + merged * BLOCK_SECTOR_SIZE,
+                run[i]->data + j * BLOCK_SECTOR_SIZE,
+                (k - j) * BLOCK_SECTOR_SIZE);
+        merged += k - j;
+        written += k - j;
+      }
+  if (merged > 0)
+    block_write_multiple (fs_device, first, flush_buffer, merged);
 
   lock_acquire (&cache_lock);
-  for (e = list_begin (&buffer_cache); e != list_end (&buffer_cache);
-       e = list_next (e))
+  for (i = 0; i < cnt; i++)
     {
-      entry = list_entry (e, struct cache_entry, elem);
-      if (entry->dirty && entry->sector != EMPTY)
-       {
-         block_write (fs_device, entry->sector, entry->data);      
-	 entry->dirty = false;
-       }
+      cache_rw_release (run[i], CACHE_READ);
+      cache_unpin (run[i]);
     }
-   lock_release (&cache_lock);
+  lock_release (&cache_lock);
+  return written;
+}
+
+/* Returns true if some dirty sector of ENTRY was written for the
+   inode at sector OWNER.  Must be called with cache_lock held. */
+static bool
+cache_owned_by (struct cache_entry *entry, block_sector_t owner)
+{
+  size_t i;
+
+  for (i = 0; i < CACHE_BLOCK_SECTORS; i++)
+    if ((entry->dirty & (1u << i)) && entry->owner[i] == owner)
+      return true;
+  return false;
+}
+
+/* Writes the sectors of ENTRY in mask DIRTY to disk, with one
+   device request per run of consecutive sectors.  Returns the
+   number of sectors written. */
+static size_t
+cache_write_back (struct cache_entry *entry, unsigned dirty)
+{
+  size_t written = 0, i, j;
+
+  for (i = 0; i < CACHE_BLOCK_SECTORS; i = j)
+    {
+      if (!(dirty & (1u << i)))
+        {
+          j = i + 1;
+          continue;
+        }
+      for (j = i + 1; j < CACHE_BLOCK_SECTORS && (dirty & (1u << j)); j++)
+        continue;
+      block_write_multiple (fs_device, entry->sector + i,
+			    entry->data + i * BLOCK_SECTOR_SIZE, j - i);
+      written += j - i;
+    }
+  return written;
+}
+
+/* Orders pointers to cache entries by sector number, for qsort() */
+static int
+cache_sector_cmp (const void *a_, const void *b_)
+{
+  const struct cache_entry *a = *(struct cache_entry * const *) a_;
+  const struct cache_entry *b = *(struct cache_entry * const *) b_;
+
+  return a->sector < b->sector ? -1 : a->sector > b->sector;
+}
+
+/* Clears ENTRY's dirty bit, waking throttled writers once few
+   enough slots are dirty.  Must be called with cache_lock held. */
+static void
+cache_mark_clean (struct cache_entry *entry)
+{
+  ASSERT (entry->dirty);
+  entry->dirty = 0;
+  dirty_cnt--;
+  if (!cache_dirty_over (dirty_ratio))
+    cond_broadcast (&dirty_below, &cache_lock);
+}
+
+/* Returns true if more than RATIO percent of the slots are dirty */
+static bool
+cache_dirty_over (int ratio)
+{
+  return dirty_cnt * 100 > (size_t) ratio * cache_size;
+}
+
+/* Puts the calling writer to sleep while more than the dirty
+   ratio of the cache is dirty, until the write-behind daemon has
+   caught up.  The daemon itself goes on.  Must not be called while
+   holding a cache slot, or any lock the daemon may wait for. */
+void
+cache_throttle (void)
+{
+  if (thread_current () == write_behind_thread)
+    return;
+  lock_acquire (&cache_lock);
+  while (cache_dirty_over (dirty_ratio))
+    cond_wait (&dirty_below, &cache_lock);
+  lock_release (&cache_lock);
+}
+
+/* Sets the age, in timer ticks, after which the write-behind
+   daemon writes a dirty slot back */
+void
+cache_set_dirty_expire (int64_t ticks)
+{
+  dirty_expire = ticks > 0 ? ticks : 0;
+}
+
+/* Sets the percentage of dirty slots above which writers are
+   throttled */
+void
+cache_set_dirty_ratio (int percent)
+{
+  dirty_ratio = percent < 1 ? 1 : percent > 100 ? 100 : percent;
+}
+
+/* Gives a page of slots back when the kernel pool runs low on
+   free pages, and takes it again, up to cache_target, once memory
+   is available */
+static void
+cache_balance (void)
+{
+  size_t free_pages = palloc_free_cnt (0);
+
+  lock_acquire (&resize_lock);
+  lock_acquire (&cache_lock);
+  if (free_pages < CACHE_LOW_PAGES && cache_size > CACHE_MIN_SIZE)
+    cache_remove_page ();
+  else if (free_pages > 2 * CACHE_LOW_PAGES && cache_size < cache_target)
+    cache_add_page ();
+  lock_release (&cache_lock);
+  lock_release (&resize_lock);
 }
 
-/* Function exectued by the write-behind daemon */
+/* Function exectued by the write-behind daemon.  Writes back the
+   slots that have been dirty for longer than dirty_expire, or all
+   of them once half of the dirty ratio is reached, so throttled
+   writers are let go soon, after allocating sectors for the data
+   of files waiting for them.  Also resizes the cache to follow
+   memory pressure. */
 void
 write_behind_daemon (void *aux UNUSED)
 {
+  bool flush_all;
+
+  write_behind_thread = thread_current ();
   while (true)
    {
-     buffer_cache_flush ();
      timer_sleep (FLUSH_FREQUENCY);
+     cache_balance ();
+
+     /* Data written to holes gets its sectors now, a run per file,
+        and joins the dirty slots. */
+     inode_flush_delayed (false);
+
+     lock_acquire (&cache_lock);
+     flush_all = cache_dirty_over (dirty_ratio / 2);
+     lock_release (&cache_lock);
+
+     if (flush_all)
+       buffer_cache_flush ();
+     else
+       cache_flush_dirty (timer_ticks () - dirty_expire, EMPTY);
    }
 }
 
-void
-cache_write (block_sector_t sector, void *buffer, int valid_bytes)
+/* Returns the cache block holding SECTOR, reading the sector from
+   disk if it is not cached.  The slot stays pinned, and held shared
+   (CACHE_READ) or exclusive (CACHE_WRITE) according to MODE, until
+   it is released with cache_put().  The sector's data, at
+   cache_data(), may be used freely until then.
+   In CACHE_OVERWRITE mode the slot is held exclusive and the
+   sector is not read: the caller must fill all of it. */
+struct cache_entry *
+cache_get (block_sector_t sector, enum cache_mode mode,
+	   enum cache_class class)
 {
-  if (lock_try_acquire (&cache_lock))
-      lock_release (&cache_lock);
+  return cache_load (sector, 1, mode, class, false);
+}
+
+/* Like cache_get(), for the CNT sectors starting at SECTOR, which
+   must fall in a single cache block.  The missing sectors are read
+   with one device request per run of consecutive ones: a single
+   request unless some sectors in between are cached. */
+struct cache_entry *
+cache_get_range (block_sector_t sector, size_t cnt, enum cache_mode mode,
+		 enum cache_class class)
+{
+  return cache_load (sector, cnt, mode, class, false);
+}
 
-  struct cache_entry *entry = find_cache_entry (sector, false); 
-  if (!entry)
+/* Returns the data of SECTOR in ENTRY, obtained from cache_get()
+   or cache_get_range() for it */
+void *
+cache_data (struct cache_entry *entry, block_sector_t sector)
+{
+  ASSERT (sector - entry->sector < CACHE_BLOCK_SECTORS);
+  return entry->data + (sector - entry->sector) * BLOCK_SECTOR_SIZE;
+}
+
+/* Does the work of cache_get_range().  PREFETCH tells a read-ahead
+   load from a demand access, for the statistics. */
+static struct cache_entry *
+cache_load (block_sector_t sector, size_t cnt, enum cache_mode mode,
+	    enum cache_class class, bool prefetch)
+{
+  struct cache_entry *entry;
+  unsigned mask = cache_range_mask (sector, cnt);
+  size_t loaded = 0;
+  bool claimed = false;
+
+  lock_acquire (&cache_lock);
+  while ((entry = cache_lookup (sector)) == NULL)
    {
-     entry = find_cache_entry (sector, true);
+     entry = evict_cache_entry (class);
+
+     /* Someone else may have brought SECTOR in while the eviction
+        waited for a slot to be unpinned */
+     if (cache_lookup (sector) != NULL)
+       continue;
+
+     /* Claim the empty slot for SECTOR's block */
+     entry->sector = sector - sector % CACHE_BLOCK_SECTORS;
+     entry->class = CACHE_DATA;
+     class_cnt[CACHE_DATA]++;
+     hash_insert (&cache_index, &entry->hash_elem);
+     cache_queue_insert (entry);
+     claimed = true;
    }
- 
-  lock_acquire (&entry->update_lock);
+
+  /* The sectors may have been freed and reused for another kind of
+     block since they were cached */
+  cache_set_class (entry, mask, class);
   entry->open_count++;
-  lock_release (&entry->update_lock);
 
-  memcpy (entry->data, buffer, valid_bytes);
-  entry->sector = sector;
-  entry->valid_bytes = valid_bytes;
-  entry->dirty = true;
+  /* Load the missing sectors holding the slot exclusively, so that
+     other threads wanting them wait for the data */
+  if ((entry->valid & mask) != mask)
+   {
+     cache_rw_acquire (entry, CACHE_WRITE);
+     loaded = cache_fill (entry, sector, cnt, mode == CACHE_OVERWRITE);
+     if (mode == CACHE_READ)
+      {
+        cache_rw_release (entry, CACHE_WRITE);
+        cache_rw_acquire (entry, CACHE_READ);
+      }
+   }
+  else
+    cache_rw_acquire (entry, mode);
+  if (mode != CACHE_READ)
+   {
+     entry->write_mask = mask;
+     cache_set_owner (entry, EMPTY);
+   }
 
-  lock_acquire (&entry->update_lock);
-  entry->open_count--;
-  lock_release (&entry->update_lock);
+  if (prefetch)
+   {
+     stats.read_ahead_loads += loaded;
+     entry->prefetched |= loaded > 0 ? mask : 0;
+   }
+  else
+   {
+     bool miss = claimed || loaded > 0;
+     if (miss)
+       stats.misses++;
+     else
+       stats.hits++;
+     if (class == CACHE_META)
+      {
+        if (miss)
+          stats.meta_misses++;
+        else
+          stats.meta_hits++;
+      }
+     stats.read_ahead_hits += cache_count_bits (entry->prefetched & mask);
+     entry->prefetched &= ~mask;
+     entry->accessed = true;
+
+     /* Slots used once stay on the 2Q in queue, however many times
+        they are touched while there */
+     if (!claimed && entry->queue == CACHE_Q_MAIN)
+       cache_queue_move (entry, CACHE_Q_MAIN);
+   }
+  lock_release (&cache_lock);
+  return entry;
 }
 
-struct cache_entry *
-cache_read (block_sector_t sector, int read_bytes)
+/* Makes the CNT sectors of ENTRY starting at SECTOR valid.  The
+   missing ones are read from disk, a run of consecutive sectors
+   per device request, unless OVERWRITE says that the caller is
+   about to fill them.  Returns the number of sectors read.
+   Must be called with cache_lock held and ENTRY held exclusive;
+   cache_lock is released while the disk is busy. */
+static size_t
+cache_fill (struct cache_entry *entry, block_sector_t sector, size_t cnt,
+	    bool overwrite)
 {
-  if (lock_try_acquire (&cache_lock))
-      lock_release (&cache_lock);
+  size_t first = sector - entry->sector, end = first + cnt;
+  unsigned valid = entry->valid;
+  size_t loaded = 0, i, j;
 
-  int zero_bytes;
-  struct cache_entry *entry = find_cache_entry (sector, false);
-  if (!entry)
-    {
-      entry = find_cache_entry (sector, true);
-      block_read (fs_device, sector, entry->data);
-    }
+  if (!overwrite)
+   {
+     lock_release (&cache_lock);
+     for (i = first; i < end; i = j)
+      {
+        if (valid & (1u << i))
+         {
+           j = i + 1;
+           continue;
+         }
+        for (j = i + 1; j < end && !(valid & (1u << j)); j++)
+          continue;
+        block_read_multiple (fs_device, entry->sector + i,
+			     entry->data + i * BLOCK_SECTOR_SIZE, j - i);
+        loaded += j - i;
+      }
+     lock_acquire (&cache_lock);
+   }
+  entry->valid |= cache_range_mask (sector, cnt);
+  return loaded;
+}
 
-  lock_acquire (&entry->update_lock);
-  entry->open_count++;
-  lock_release (&entry->update_lock);
+/* Records that the sectors in MASK of ENTRY hold CLASS, and counts
+   ENTRY as metadata while any of its sectors holds metadata.  Files
+   are allocated next to their inodes, so a block often holds both,
+   and its data must not make it evictable as data.
+   Must be called with cache_lock held. */
+static void
+cache_set_class (struct cache_entry *entry, unsigned mask,
+		 enum cache_class class)
+{
+  enum cache_class block_class;
 
-  entry->valid_bytes = read_bytes;
-  entry->sector = sector;
-  zero_bytes = BLOCK_SECTOR_SIZE - entry->valid_bytes;
-  if (zero_bytes != 0)
+  if (class == CACHE_META)
+    entry->meta |= mask;
+  else
+    entry->meta &= ~mask;
+  block_class = entry->meta != 0 ? CACHE_META : CACHE_DATA;
+  if (entry->class != block_class)
    {
-     memset (entry->data + read_bytes, 0, zero_bytes);
+     class_cnt[entry->class]--;
+     class_cnt[block_class]++;
+     entry->class = block_class;
    }
-  lock_acquire (&entry->update_lock);
-  entry->open_count--;
-  lock_release (&entry->update_lock);
+}
 
-  return entry;
+/* Returns the mask of the CNT sectors starting at SECTOR within
+   their cache block */
+static unsigned
+cache_range_mask (block_sector_t sector, size_t cnt)
+{
+  size_t first = sector % CACHE_BLOCK_SECTORS;
+
+  ASSERT (cnt > 0 && first + cnt <= CACHE_BLOCK_SECTORS);
+  return (cnt == 32 ? ~0u : (1u << cnt) - 1) << first;
 }
 
-struct cache_entry *
-allocate_cache_entry ()
+/* Returns the number of bits set in MASK */
+static size_t
+cache_count_bits (unsigned mask)
 {
-    struct cache_entry *entry = NULL;
+  size_t cnt = 0;
 
-     entry = calloc (1, sizeof (struct cache_entry));
-     entry->sector = EMPTY;
-     entry->dirty = false;
-     entry->valid_bytes = EMPTY;
-     lock_init (&entry->update_lock);
-     return entry;
+  for (; mask != 0; mask &= mask - 1)
+    cnt++;
+  return cnt;
 }
 
-/* Looks for a cache_entry in buffer_cache based on sector number.
-   If found, removes and pushes it to front of the list.
-   @param: sector_id - sector number of needed cache_entry
-           unused    - Do we need to find an unused cache_entry?
-   @retval: pointer to the cache_entry found */
-struct cache_entry *
-find_cache_entry (block_sector_t sector_id, bool unused)
+/* Records that the sectors of ENTRY held for writing are written
+   for the inode at sector INUMBER, so that fsync() on it writes
+   them back.  Must be called between cache_get() and cache_put(),
+   with ENTRY obtained in CACHE_WRITE or CACHE_OVERWRITE mode. */
+void
+cache_set_owner (struct cache_entry *entry, block_sector_t inumber)
+{
+  size_t i;
+
+  ASSERT (entry->writing);
+  for (i = 0; i < CACHE_BLOCK_SECTORS; i++)
+    if (entry->write_mask & (1u << i))
+      entry->owner[i] = inumber;
+}
+
+/* Releases ENTRY, obtained from cache_get() with the same MODE.
+   The sectors obtained in CACHE_WRITE or CACHE_OVERWRITE mode are
+   marked dirty. */
+void
+cache_put (struct cache_entry *entry, enum cache_mode mode)
 {
-  struct cache_entry *entry = NULL;
+  lock_acquire (&cache_lock);
+  if (mode != CACHE_READ)
+   {
+     if (!entry->dirty)
+      {
+        entry->dirty_since = timer_ticks ();
+        dirty_cnt++;
+        list_push_back (&dirty_list, &entry->dirty_elem);
+      }
+     entry->dirty |= entry->write_mask;
+   }
+  cache_rw_release (entry, mode);
+  cache_unpin (entry);
+  lock_release (&cache_lock);
+}
+
+/* Brings the CNT sectors starting at SECTOR, which hold CLASS and
+   fall in a single cache block, into the cache if they are not
+   there already, without keeping them pinned.  Used for
+   read-ahead. */
+void
+cache_prefetch (block_sector_t sector, size_t cnt, enum cache_class class)
+{
+  struct cache_entry *entry;
+  unsigned mask = cache_range_mask (sector, cnt);
+  bool cached;
+
+  lock_acquire (&cache_lock);
+  entry = cache_lookup (sector);
+  cached = entry != NULL && (entry->valid & mask) == mask;
+  lock_release (&cache_lock);
+
+  if (!cached)
+    cache_put (cache_load (sector, cnt, CACHE_READ, class, true),
+	       CACHE_READ);
+}
+
+/* Fills SECTOR, newly allocated to the inode at sector INUMBER,
+   with zeros in the cache, without reading it.  It reaches the disk
+   on write back.  The slot counts as data until its first use says
+   otherwise. */
+void
+cache_zero (block_sector_t sector, block_sector_t inumber)
+{
+  struct cache_entry *entry = cache_get (sector, CACHE_OVERWRITE, CACHE_DATA);
+  memset (cache_data (entry, sector), 0, BLOCK_SECTOR_SIZE);
+  cache_set_owner (entry, inumber);
+  cache_put (entry, CACHE_OVERWRITE);
+}
+
+/* Fills HOT with up to MAX of the blocks the cache holds, those
+   most worth keeping first, and returns how many it filled in.
+   The 2Q main queue comes before the in queue, each from most to
+   least recently used. */
+size_t
+cache_get_hot (struct cache_hot *hot, size_t max)
+{
+  static const enum cache_queue order[] = { CACHE_Q_MAIN, CACHE_Q_IN };
   struct list_elem *e;
-  block_sector_t sector = (unused == true)? EMPTY:sector_id;
+  size_t cnt = 0;
+  size_t i;
+
+  lock_acquire (&cache_lock);
+  for (i = 0; i < sizeof order / sizeof *order; i++)
+    for (e = list_begin (&cache_queues[order[i]]);
+         e != list_end (&cache_queues[order[i]]) && cnt < max;
+         e = list_next (e))
+     {
+       struct cache_entry *entry = list_entry (e, struct cache_entry,
+                                               queue_elem);
+       if (entry->sector == EMPTY || entry->valid == 0)
+         continue;
+       hot[cnt].sector = entry->sector;
+       hot[cnt].valid = entry->valid;
+       hot[cnt].class = entry->class;
+       cnt++;
+     }
+  lock_release (&cache_lock);
+  return cnt;
+}
+
+/* Copies the buffer cache statistics into *ST.  The read-ahead
+   window is left for the caller to fill in. */
+void
+cache_get_stats (struct cache_stats *st)
+{
+  lock_acquire (&cache_lock);
+  *st = stats;
+  st->size = cache_size;
+  st->dirty = dirty_cnt;
+  st->meta = class_cnt[CACHE_META];
+  lock_release (&cache_lock);
+  st->read_ahead_window = -1;
+}
+
+/* Prints buffer cache statistics. */
+void
+cache_print_stats (void)
+{
+  struct cache_stats st;
 
-  for (e = list_begin (&buffer_cache); e != list_end (&buffer_cache);
-       e = list_next (e))
+  cache_get_stats (&st);
+  printf ("Buffer cache: %u slots of %d sectors (%s), %llu hits, "
+	  "%llu misses, %llu evictions (%llu dirty)\n",
+	  st.size, CACHE_BLOCK_SECTORS, policy_names[cache_policy],
+	  st.hits, st.misses,
+	  st.evictions, st.dirty_evictions);
+  printf ("Buffer cache: %u metadata slots, %llu hits, %llu misses\n",
+	  st.meta, st.meta_hits, st.meta_misses);
+  printf ("Buffer cache: %llu flushes, %llu sectors written, "
+	  "%llu ticks flushing, %llu dirty sectors discarded\n",
+	  st.flushes, st.flush_writes, st.flush_ticks, st.discards);
+  printf ("Buffer cache: %llu sectors read ahead, %llu used\n",
+	  st.read_ahead_loads, st.read_ahead_hits);
+}
+
+/* Forgets the cached copies of the sectors in MASK of ENTRY, dirty
+   or not.  The slot is dropped once none of its sectors is cached,
+   unless it is pinned.  Must be called with cache_lock held. */
+static void
+cache_forget (struct cache_entry *entry, unsigned mask)
+{
+  if (entry->dirty & mask)
    {
-     entry = list_entry (e, struct cache_entry, elem);
-     if (entry->sector == sector)
+     stats.discards += cache_count_bits (entry->dirty & mask);
+     if ((entry->dirty & ~mask) == 0)
       {
-       list_remove (e);
-       list_push_front (&buffer_cache, &entry->elem);
-       return entry;
+        list_remove (&entry->dirty_elem);
+        cache_mark_clean (entry);
       }
    }
-   /* If an unused sector is requested and is not present in cache,
-      evict a cache_entry and return it */
-   if (sector == EMPTY)
+  entry->dirty &= ~mask;
+  entry->prefetched &= ~mask;
+  entry->valid &= ~mask;
+  cache_set_class (entry, mask, CACHE_DATA);
+  if (entry->valid == 0 && entry->open_count == 0)
+   {
+     cache_ghost_remove (entry->sector);
+     cache_entry_drop (entry);
+   }
+}
+
+/* Forgets the cached copies of the CNT sectors in SECTORS, which
+   have been freed, so that they are never read from the cache or
+   written back again. */
+void
+cache_invalidate (const block_sector_t *sectors, size_t cnt)
+{
+  struct cache_entry *entry;
+  size_t i;
+
+  lock_acquire (&cache_lock);
+  for (i = 0; i < cnt; i++)
+   {
+     entry = cache_lookup (sectors[i]);
+     if (entry != NULL)
+       cache_forget (entry, cache_range_mask (sectors[i], 1));
+   }
+  lock_release (&cache_lock);
+}
+
+/* Checks whether the CNT sectors starting at SECTOR may be
+   transferred in MODE straight between the device and the caller's
+   buffer.  A read may bypass the cache unless one of the sectors
+   is dirty in it; a write drops the cached copies it makes stale.
+   Neither may while a slot holding the sectors is pinned, as it
+   may be loading or writing them back.  Returns true if the
+   transfer may bypass the cache, false if it must go through it. */
+bool
+cache_bypass (block_sector_t sector, size_t cnt, enum cache_mode mode)
+{
+  struct cache_entry *entry;
+  block_sector_t end = sector + cnt;
+  block_sector_t s;
+  size_t n;
+  bool bypass = true;
+
+  lock_acquire (&cache_lock);
+  for (s = sector; bypass && s < end; s += n)
     {
-      lock_acquire (&cache_lock);
-      evict_cache_entry ();
-      entry = allocate_cache_entry ();
-      list_push_front (&buffer_cache, &entry->elem);
-      lock_release (&cache_lock);
-      return entry; 
-    } 
-  return NULL;   
+      n = CACHE_BLOCK_SECTORS - s % CACHE_BLOCK_SECTORS;
+      if (n > end - s)
+        n = end - s;
+      entry = cache_lookup (s);
+      if (entry != NULL
+          && (entry->open_count > 0
+              || (mode == CACHE_READ
+                  && (entry->dirty & cache_range_mask (s, n)))))
+        bypass = false;
+    }
+  if (bypass && mode != CACHE_READ)
+    for (s = sector; s < end; s += n)
+      {
+        n = CACHE_BLOCK_SECTORS - s % CACHE_BLOCK_SECTORS;
+        if (n > end - s)
+          n = end - s;
+        entry = cache_lookup (s);
+        if (entry != NULL)
+          cache_forget (entry, cache_range_mask (s, n));
+      }
+  lock_release (&cache_lock);
+  return bypass;
 }
 
+/* Forgets the clean cached copies of the CNT sectors starting at
+   SECTOR, just written to the device behind the cache's back by a
+   transfer cache_bypass() let through.  A slot holding them that is
+   pinned may be loading their old contents from disk, so it is
+   waited for first.  Dirty copies were written after the transfer
+   started, and are kept. */
 void
-evict_cache_entry ()
+cache_discard (block_sector_t sector, size_t cnt)
 {
-  struct list_elem *e; 
   struct cache_entry *entry;
-  bool found = false;
+  block_sector_t end = sector + cnt;
+  block_sector_t s;
+  size_t n;
 
+  lock_acquire (&cache_lock);
+  for (s = sector; s < end; s += n)
+    {
+      n = CACHE_BLOCK_SECTORS - s % CACHE_BLOCK_SECTORS;
+      if (n > end - s)
+        n = end - s;
+      while ((entry = cache_lookup (s)) != NULL && entry->open_count > 0)
+        cond_wait (&cache_unpinned, &cache_lock);
+      if (entry != NULL)
+        cache_forget (entry, cache_range_mask (s, n) & ~entry->dirty);
+    }
+  lock_release (&cache_lock);
+}
+
+/* Initializes cache slot ENTRY as unused */
+static void
+cache_entry_init (struct cache_entry *entry)
+{
+  entry->sector = EMPTY;
+  entry->meta = 0;
+  entry->valid = 0;
+  entry->dirty = 0;
+  entry->write_mask = 0;
+  entry->flush_mask = 0;
+  entry->accessed = false;
+  entry->prefetched = 0;
+  entry->open_count = 0;
+  entry->readers = 0;
+  entry->writing = false;
+}
+
+/* Empties ENTRY, which holds a sector: takes it out of
+   cache_index and of its class, and queues it as unused.
+   Must be called with cache_lock held. */
+static void
+cache_entry_drop (struct cache_entry *entry)
+{
+  class_cnt[entry->class]--;
+  cache_index_remove (entry);
+  cache_entry_init (entry);
+  cache_queue_move (entry, CACHE_Q_FREE);
+}
+
+/* Waits until ENTRY may be held in MODE and takes it: any number
+   of readers, or a single writer.
+   Must be called with cache_lock held and ENTRY pinned. */
+static void
+cache_rw_acquire (struct cache_entry *entry, enum cache_mode mode)
+{
+  ASSERT (lock_held_by_current_thread (&cache_lock));
+  ASSERT (entry->open_count > 0);
+
+  if (mode == CACHE_READ)
+   {
+     while (entry->writing)
+       cond_wait (&entry->rw_changed, &cache_lock);
+     entry->readers++;
+   }
+  else
+   {
+     while (entry->writing || entry->readers > 0)
+       cond_wait (&entry->rw_changed, &cache_lock);
+     entry->writing = true;
+   }
+}
+
+/* Gives up ENTRY, held in MODE, waking up threads waiting for it.
+   Must be called with cache_lock held. */
+static void
+cache_rw_release (struct cache_entry *entry, enum cache_mode mode)
+{
+  ASSERT (lock_held_by_current_thread (&cache_lock));
+
+  if (mode == CACHE_READ)
+   {
+     ASSERT (entry->readers > 0);
+     if (--entry->readers == 0)
+       cond_broadcast (&entry->rw_changed, &cache_lock);
+   }
+  else
+   {
+     ASSERT (entry->writing);
+     entry->writing = false;
+     cond_broadcast (&entry->rw_changed, &cache_lock);
+   }
+}
+
+/* Drops a pin on ENTRY and wakes up evictors, and a shrinking
+   cache, waiting for ENTRY to be unpinned.
+   Must be called with cache_lock held. */
+static void
+cache_unpin (struct cache_entry *entry)
+{
+  ASSERT (lock_held_by_current_thread (&cache_lock));
+  ASSERT (entry->open_count > 0);
+  if (--entry->open_count == 0)
+    cond_broadcast (&cache_unpinned, &cache_lock);
+}
+
+/* Looks for the cache_entry for the block of a sector.
+   Must be called with cache_lock held.
+   @param: sector - sector number in the needed cache_entry
+   @retval: pointer to the cache_entry found, NULL if not cached */
+static struct cache_entry *
+cache_lookup (block_sector_t sector)
+{
+  struct cache_entry key;
+  struct hash_elem *e;
+
+  key.sector = sector - sector % CACHE_BLOCK_SECTORS;
+  e = hash_find (&cache_index, &key.hash_elem);
+  return e != NULL ? hash_entry (e, struct cache_entry, hash_elem) : NULL;
+}
+
+/* Removes ENTRY from cache_index, if it is the entry indexed for
+   its sector */
+static void
+cache_index_remove (struct cache_entry *entry)
+{
+  if (entry->sector != EMPTY
+      && hash_find (&cache_index, &entry->hash_elem) == &entry->hash_elem)
+    hash_delete (&cache_index, &entry->hash_elem);
+}
+
+/* Returns a hash value for the sector of cache_entry E */
+static unsigned
+cache_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct cache_entry *entry = hash_entry (e, struct cache_entry,
+						hash_elem);
+  return hash_int ((int) entry->sector);
+}
+
+/* Returns true if cache_entry A precedes cache_entry B */
+static bool
+cache_less (const struct hash_elem *a, const struct hash_elem *b,
+	    void *aux UNUSED)
+{
+  return hash_entry (a, struct cache_entry, hash_elem)->sector
+	 < hash_entry (b, struct cache_entry, hash_elem)->sector;
+}
+
+/* Picks a cache slot to reuse for a sector of CLASS with the
+   replacement policy in use and empties it.  Once data fills its
+   share of the cache, a data sector may only replace another one.
+   If no slot qualifies because they are pinned, waits for one to
+   be unpinned.  A dirty victim is written back first the way a
+   flush does it, pinned and held shared, with cache_lock released
+   while the disk is busy; then a victim is picked again, as the
+   slot may have been used meanwhile.
+   Must be called with cache_lock held.
+   @retval: the unused, unpinned slot */
+static struct cache_entry *
+evict_cache_entry (enum cache_class class)
+{
+  struct cache_entry *entry;
+  size_t data_max;
+  unsigned dirty;
+  bool data_only;
+
+  ASSERT (lock_held_by_current_thread (&cache_lock));
   while (true)
-  {
-     for (e = list_rbegin (&buffer_cache); e != list_rend (&buffer_cache);
-          e = list_prev (e))
-      { 
-        entry = list_entry (e, struct cache_entry, elem);
-         if (entry->open_count == 0)
-          {
-           found = true;
-           break;
-          }
-       }
-     if (found)
+   {
+     data_max = cache_size - cache_size * meta_reserve / 100;
+     data_only = class == CACHE_DATA && class_cnt[CACHE_DATA] >= data_max;
+     if (cache_policy == CACHE_POLICY_CLOCK)
+       entry = cache_clock_victim (data_only);
+     else
+       entry = cache_queue_victim (data_only);
+     if (entry == NULL)
+       cond_wait (&cache_unpinned, &cache_lock);
+     else if (!entry->dirty)
        break;
-    }   
+     else
+      {
+        dirty = entry->dirty;
+        list_remove (&entry->dirty_elem);
+        cache_mark_clean (entry);
+        stats.dirty_evictions++;
+        entry->open_count++;
+        cache_rw_acquire (entry, CACHE_READ);
+        lock_release (&cache_lock);
+
+        cache_write_back (entry, dirty);
 
-  if (entry->dirty)
+        lock_acquire (&cache_lock);
+        cache_rw_release (entry, CACHE_READ);
+        cache_unpin (entry);
+      }
+   }
+
+  if (entry->sector != EMPTY)
+   {
+     stats.evictions++;
+     if (entry->queue == CACHE_Q_IN)
+       cache_ghost_add (entry->sector);
+     cache_entry_drop (entry);
+   }
+  return entry;
+}
+
+/* Returns true if unpinned slot ENTRY may be evicted; only slots
+   holding data if DATA_ONLY. */
+static bool
+cache_victim_ok (struct cache_entry *entry, bool data_only)
+{
+  return entry->open_count == 0
+	 && (!data_only
+	     || (entry->sector != EMPTY && entry->class == CACHE_DATA));
+}
+
+/* Picks a victim with the clock (second chance) algorithm.  Slots
+   with their reference bit set have it cleared and are skipped
+   once.  Clean slots are preferred, so that a miss only pays for a
+   synchronous write back when every candidate is dirty.  Only
+   data slots are candidates if DATA_ONLY.
+   Returns NULL if there is no candidate. */
+static struct cache_entry *
+cache_clock_victim (bool data_only)
+{
+  struct cache_entry *entry, *dirty_victim = NULL;
+  size_t i;
+
+  /* Two sweeps: the first clears every reference bit */
+  for (i = 0; i < 2 * cache_size; i++)
+   {
+     entry = cache_slot (clock_hand);
+     clock_hand = (clock_hand + 1) % cache_size;
+     if (!cache_victim_ok (entry, data_only))
+       continue;
+     if (entry->accessed)
+       entry->accessed = false;
+     else if (!entry->dirty)
+       return entry;
+     else if (dirty_victim == NULL)
+       dirty_victim = entry;
+   }
+  return dirty_victim;
+}
+
+/* Picks a victim for the LRU and 2Q policies: an unused slot if
+   there is one, else the oldest slot of the 2Q in queue while it
+   holds more than its quarter of the cache, else the least
+   recently used slot, clean ones first as cache_queue_last()
+   picks them.  Only data slots are candidates if DATA_ONLY.
+   Returns NULL if there is no candidate. */
+static struct cache_entry *
+cache_queue_victim (bool data_only)
+{
+  struct cache_entry *entry;
+
+  if ((entry = cache_queue_last (CACHE_Q_FREE, data_only)) != NULL)
+    return entry;
+  if (in_cnt > cache_size / 4
+      && (entry = cache_queue_last (CACHE_Q_IN, data_only)) != NULL)
+    return entry;
+  if ((entry = cache_queue_last (CACHE_Q_MAIN, data_only)) != NULL)
+    return entry;
+  return cache_queue_last (CACHE_Q_IN, data_only);
+}
+
+/* Returns the least recent slot on queue Q that may be evicted,
+   or NULL.  Like the clock, prefers a clean slot, so that a miss
+   only pays for a write back when the VICTIM_SCAN_MAX least recent
+   candidates are all dirty; the least recent of them is taken
+   then. */
+static struct cache_entry *
+cache_queue_last (enum cache_queue q, bool data_only)
+{
+  struct cache_entry *dirty_victim = NULL;
+  struct list_elem *e;
+  size_t seen = 0;
+
+  for (e = list_rbegin (&cache_queues[q]);
+       e != list_rend (&cache_queues[q]) && seen < VICTIM_SCAN_MAX;
+       e = list_prev (e))
    {
-     block_write (fs_device, entry->sector, entry->data);
+     struct cache_entry *entry = list_entry (e, struct cache_entry,
+					     queue_elem);
+     if (!cache_victim_ok (entry, data_only))
+       continue;
+     if (!entry->dirty)
+       return entry;
+     if (dirty_victim == NULL)
+       dirty_victim = entry;
+     seen++;
    }
-  list_remove (e);
-  free (entry);
+  return dirty_victim;
+}
+
+/* Queues ENTRY, just loaded with a new sector.  2Q puts sectors
+   seen for the first time on the in queue, so that a scan of
+   blocks used once cannot push reused blocks out. */
+static void
+cache_queue_insert (struct cache_entry *entry)
+{
+  if (cache_policy == CACHE_POLICY_2Q && !cache_ghost_remove (entry->sector))
+    cache_queue_move (entry, CACHE_Q_IN);
+  else
+    cache_queue_move (entry, CACHE_Q_MAIN);
+}
+
+/* Moves ENTRY to the front of queue Q */
+static void
+cache_queue_move (struct cache_entry *entry, enum cache_queue q)
+{
+  cache_queue_remove (entry);
+  entry->queue = q;
+  if (q == CACHE_Q_IN)
+    in_cnt++;
+  list_push_front (&cache_queues[q], &entry->queue_elem);
+}
+
+/* Takes ENTRY off its queue */
+static void
+cache_queue_remove (struct cache_entry *entry)
+{
+  if (entry->queue == CACHE_Q_IN)
+    in_cnt--;
+  list_remove (&entry->queue_elem);
 }
 
+/* Remembers SECTOR as just evicted from the 2Q in queue, forgetting
+   the oldest sectors beyond cache_size / 2 */
+static void
+cache_ghost_add (block_sector_t sector)
+{
+  while (ghost_cnt > 0 && ghost_cnt >= cache_size / 2)
+   {
+     ghost_head = (ghost_head + 1) % GHOST_MAX;
+     ghost_cnt--;
+   }
+  ghosts[(ghost_head + ghost_cnt) % GHOST_MAX] = sector;
+  ghost_cnt++;
+}
+
+/* Forgets SECTOR if it is on the ghost queue.  Returns true if it
+   was.  A linear scan: it is done on misses only, next to a disk
+   read. */
+static bool
+cache_ghost_remove (block_sector_t sector)
+{
+  size_t i;
+
+  for (i = 0; i < ghost_cnt; i++)
+   {
+     block_sector_t *ghost = &ghosts[(ghost_head + i) % GHOST_MAX];
+     if (*ghost == sector)
+      {
+        *ghost = EMPTY;
+        return true;
+      }
+   }
+  return false;
+}
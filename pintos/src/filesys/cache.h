@@ -1,41 +1,123 @@
 #ifndef FILESYS_CACHE_H
 #define FILESYS_CACHE_H
 
+#include <hash.h>
 #include <list.h>
 #include <limits.h>
+#include <stddef.h>
+#include <cache-stats.h>
 #include "devices/block.h"
 #include "threads/synch.h"
 #include "filesys/off_t.h"
 
-#define BUFFER_CACHE_SIZE 64
+#define BUFFER_CACHE_SIZE 64	/* Default size, in slots */
+#define CACHE_BLOCK_SECTORS 8	/* Consecutive sectors per cache block:
+				   a power of 2, at most PGSIZE worth */
+#define CACHE_BLOCK_SIZE (CACHE_BLOCK_SECTORS * BLOCK_SECTOR_SIZE)
 #define EMPTY UINT_MAX 
 
-/* Buffer Cache: List of 64 cache entries */
-static struct list buffer_cache;
-
-/* Lock acquired while evicting an entry */
+/* Lock acquired while looking up, claiming or evicting an entry */
 struct lock cache_lock;
 
-/* Each cache entry in the buffer_cache */
+/* How a cache slot is held between cache_get() and cache_put() */
+enum cache_mode
+{
+  CACHE_READ,			 /* Shared with other readers */
+  CACHE_WRITE,			 /* Exclusive; marks the slot dirty */
+  CACHE_OVERWRITE		 /* Like CACHE_WRITE, but the caller
+				    rewrites all the sectors it gets,
+				    so they are not read from disk */
+};
+
+/* What a cached sector holds.  Metadata has a share of the cache
+   reserved for it, so that bulk data transfers cannot evict it. */
+enum cache_class
+{
+  CACHE_DATA,			 /* Regular file contents */
+  CACHE_META			 /* Inodes, index blocks, directories,
+				    free map */
+};
+
+/* Replacement policies, chosen with cache_set_policy() */
+enum cache_policy
+{
+  CACHE_POLICY_CLOCK,		 /* Second chance over all the slots */
+  CACHE_POLICY_LRU,		 /* Least recently used */
+  CACHE_POLICY_2Q		 /* Scan resistant: blocks used once
+				    never displace reused ones */
+};
+
+/* Queue a cache slot is on, for the list based policies */
+enum cache_queue
+{
+  CACHE_Q_FREE,			 /* Unused */
+  CACHE_Q_IN,			 /* 2Q: used once, FIFO */
+  CACHE_Q_MAIN			 /* Reused (2Q), or every slot (LRU) */
+};
+
+/* Each cache entry in the buffer_cache: a block of
+   CACHE_BLOCK_SECTORS consecutive sectors, aligned on a multiple of
+   CACHE_BLOCK_SECTORS.  The masks below have bit I for sector I of
+   the block. */
 struct cache_entry
 {
-  char data[BLOCK_SECTOR_SIZE]; /* Data block in each cache_entry */
-  block_sector_t sector;	 /* On-disk sector number for the entry */
-  bool dirty;			 /* Dirty bit for cache_entry */
+  char *data;			 /* Data block of this slot */
+  block_sector_t sector;	 /* First on-disk sector of the block */
+  enum cache_class class;	 /* CACHE_META if any sector is in META */
+  unsigned meta;		 /* Sectors holding metadata */
+  unsigned valid;		 /* Sectors loaded */
+  unsigned dirty;		 /* Sectors modified since loaded */
+  unsigned write_mask;		 /* Sectors held by the writer */
+  unsigned flush_mask;		 /* Sectors being written by a flush */
+  block_sector_t owner[CACHE_BLOCK_SECTORS]; /* Inode that last wrote
+						each sector, or EMPTY */
+  int64_t dirty_since;		 /* Tick at which it was last dirtied */
+  bool accessed;		 /* Reference bit for the clock */
+  unsigned prefetched;		 /* Sectors loaded by read-ahead and
+				    not used yet */
   int open_count;		 /* Number of threads currently accessing 
-				    the entry */
-  int  valid_bytes;		 /* Number of valid bytes in this sector*/
-  struct lock update_lock;	 /* lock acquired when growing the sector
-     				    to set is_growing */
-  struct list_elem elem;
+				    the entry; pinned while nonzero */
+  int readers;			 /* Number of threads holding it shared */
+  bool writing;			 /* Held exclusively by a writer? */
+  struct condition rw_changed;	 /* Signaled when readers/writing drop */
+  struct hash_elem hash_elem;	 /* Element in cache_index (by sector) */
+  struct list_elem dirty_elem;	 /* Element in dirty_list */
+  enum cache_queue queue;	 /* Replacement queue it is on */
+  struct list_elem queue_elem;	 /* Element in that queue */
+};
+
+/* A block held by the cache, as recorded for warming the cache up
+   on the next boot. */
+struct cache_hot
+{
+  block_sector_t sector;	 /* First sector of the block */
+  unsigned valid;		 /* Mask of its sectors cached */
+  enum cache_class class;	 /* What its sectors hold */
 };
 
 void buffer_cache_init (void);
-struct cache_entry *cache_read (block_sector_t, int);
-void cache_write (block_sector_t, void *, int);
-struct cache_entry* allocate_cache_entry (void);
-struct cache_entry* find_cache_entry (block_sector_t, bool);
-void evict_cache_entry (void);
+struct cache_entry *cache_get (block_sector_t, enum cache_mode,
+			       enum cache_class);
+struct cache_entry *cache_get_range (block_sector_t, size_t,
+				     enum cache_mode, enum cache_class);
+void *cache_data (struct cache_entry *, block_sector_t);
+void cache_set_owner (struct cache_entry *, block_sector_t);
+void cache_put (struct cache_entry *, enum cache_mode);
+void cache_prefetch (block_sector_t, size_t, enum cache_class);
+void cache_zero (block_sector_t, block_sector_t);
+void cache_invalidate (const block_sector_t *, size_t);
+bool cache_bypass (block_sector_t, size_t, enum cache_mode);
+void cache_discard (block_sector_t, size_t);
 void buffer_cache_flush (void);
+void cache_flush_owner (block_sector_t);
+void cache_set_size (size_t);
+void cache_throttle (void);
+void cache_set_dirty_expire (int64_t);
+void cache_set_dirty_ratio (int);
+bool cache_set_policy (const char *);
+void cache_set_meta_reserve (int);
+size_t cache_get_hot (struct cache_hot *, size_t);
+void cache_get_stats (struct cache_stats *);
+void cache_print_stats (void);
 
 #endif /* filesys/cache.h */
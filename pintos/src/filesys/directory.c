@@ -85,6 +85,7 @@ dir_open (struct inode *inode)
     {
       dir->inode = inode;
       dir->pos = 0;
+      inode_set_cache_class (inode, CACHE_META);
       return dir;
     }
   else
@@ -0,0 +1,446 @@
+#include "filesys/extent.h"
+#include <debug.h>
+#include <string.h>
+#include "filesys/cache.h"
+#include "filesys/free-map.h"
+#include "threads/malloc.h"
+
+/* Extent trees map the sectors of a file to runs of consecutive
+   disk sectors.  The root node lives in the inode; the other nodes
+   take a sector each and are read and written through the buffer
+   cache.  Entries in a node are sorted by file sector.  Files may
+   have holes, sectors that were never written and are mapped by no
+   extent, so an extent can be inserted anywhere; a full node splits
+   in two, and a full root moves its entries to a new node below
+   it, adding a level to the tree. */
+
+/* A node of an extent tree other than the root. */
+struct extent_node
+  {
+    struct extent_header header;
+    struct extent entries[EXTENT_NODE_CNT];
+  };
+
+/* Sectors dropped from the cache at a time when freeing a run. */
+#define RELEASE_BATCH 32
+
+/* Sectors set aside for the nodes created by an insertion, and
+   buffers for the nodes on its path below the root, one per
+   level. */
+struct node_pool
+  {
+    block_sector_t sectors[EXTENT_INSERT_MAX];
+    size_t cnt;
+    struct extent_node *nodes;
+  };
+
+static int entry_find (const struct extent *, size_t, uint32_t);
+static size_t path_full (const struct extent_root *, uint32_t);
+static bool node_insert (struct extent_header *, struct extent *, size_t,
+                         const struct extent *, struct node_pool *,
+                         block_sector_t, struct extent *);
+static bool leaf_merge (struct extent_header *, struct extent *, int,
+                        const struct extent *);
+static bool entry_add (struct extent_header *, struct extent *, size_t, int,
+                       const struct extent *, struct node_pool *,
+                       block_sector_t, struct extent *);
+static void node_read (block_sector_t, struct extent_node *);
+static void node_write (block_sector_t, const struct extent_node *,
+                        block_sector_t);
+static bool node_entry (block_sector_t, size_t, struct extent *,
+                        uint16_t *);
+static void entry_free (const struct extent *, uint16_t);
+static void release_run (block_sector_t, size_t);
+
+/* Returns the index of the last of the CNT entries in ENTRIES that
+   starts at or before file sector INDEX, or -1 if there is none. */
+static int
+entry_find (const struct extent *entries, size_t cnt, uint32_t index)
+{
+  size_t lo = 0, hi = cnt;
+
+  while (lo < hi)
+    {
+      size_t mid = (lo + hi) / 2;
+      if (entries[mid].logical <= index)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  return (int) lo - 1;
+}
+
+/* Finds the extent of the tree rooted at ROOT that maps file
+   sector INDEX and stores it in *EXT.  Reads one node per level
+   below the root.  Returns false if INDEX is not mapped. */
+bool
+extent_lookup (const struct extent_root *root, uint32_t index,
+               struct extent *ext)
+{
+  const struct extent_header *h = &root->header;
+  const struct extent *entries = root->entries;
+  struct cache_entry *entry = NULL;
+  bool found = false;
+
+  for (;;)
+    {
+      int i = entry_find (entries, h->cnt, index);
+      block_sector_t child;
+      struct extent_node *node;
+
+      if (i < 0)
+        break;
+      if (h->depth == 0)
+        {
+          if (index - entries[i].logical < entries[i].length)
+            {
+              *ext = entries[i];
+              found = true;
+            }
+          break;
+        }
+
+      child = entries[i].start;
+      if (entry != NULL)
+        cache_put (entry, CACHE_READ);
+      entry = cache_get (child, CACHE_READ, CACHE_META);
+      node = cache_data (entry, child);
+      h = &node->header;
+      entries = node->entries;
+    }
+  if (entry != NULL)
+    cache_put (entry, CACHE_READ);
+  return found;
+}
+
+/* Maps the CNT file sectors starting at INDEX, a hole, of the file
+   whose inode is at sector INUMBER, and whose extent tree is rooted
+   at ROOT, to the disk sectors starting at SECTOR.  The sectors for
+   any nodes that have to split are allocated up front, out of the
+   *RESERVED sectors reserved by the caller as far as they go (see
+   free_map_allocate_reserved()), so that the tree is left unchanged
+   if the disk is full; then false is returned. */
+bool
+extent_insert (struct extent_root *root, uint32_t index,
+               block_sector_t sector, uint32_t cnt, block_sector_t inumber,
+               size_t *reserved)
+{
+  struct node_pool pool;
+  struct extent ext, split;
+  size_t need = path_full (root, index);
+  bool split_root;
+
+  ASSERT (root->header.depth < EXTENT_MAX_DEPTH);
+  pool.nodes = malloc (EXTENT_MAX_DEPTH * sizeof *pool.nodes);
+  if (pool.nodes == NULL)
+    return false;
+  for (pool.cnt = 0; pool.cnt < need; pool.cnt++)
+    if (!free_map_allocate_reserved (1, &pool.sectors[pool.cnt], reserved))
+      {
+        while (pool.cnt > 0)
+          free_map_release (pool.sectors[--pool.cnt], 1);
+        free (pool.nodes);
+        return false;
+      }
+
+  /* The root cannot split: add a level to the tree when it is full,
+     moving its entries into a new node. */
+  if (root->header.cnt == EXTENT_ROOT_CNT)
+    {
+      block_sector_t child = pool.sectors[--pool.cnt];
+      struct cache_entry *entry = cache_get (child, CACHE_OVERWRITE,
+                                             CACHE_META);
+      struct extent_node *node = cache_data (entry, child);
+
+      memset (node, 0, sizeof *node);
+      node->header = root->header;
+      memcpy (node->entries, root->entries, sizeof root->entries);
+      cache_set_owner (entry, inumber);
+      cache_put (entry, CACHE_OVERWRITE);
+
+      root->header.depth++;
+      root->header.cnt = 1;
+      root->entries[0].logical = 0;
+      root->entries[0].start = child;
+      root->entries[0].length = 0;
+    }
+
+  ext.logical = index;
+  ext.start = sector;
+  ext.length = cnt;
+  split_root = node_insert (&root->header, root->entries, EXTENT_ROOT_CNT,
+                            &ext, &pool, inumber, &split);
+  ASSERT (!split_root);
+
+  while (pool.cnt > 0)
+    free_map_release (pool.sectors[--pool.cnt], 1);
+  free (pool.nodes);
+  return true;
+}
+
+/* Returns the number of nodes, the root included, on the path from
+   ROOT to the leaf where file sector INDEX belongs that are full.
+   Inserting an extent splits at most that many nodes. */
+static size_t
+path_full (const struct extent_root *root, uint32_t index)
+{
+  const struct extent_header *h = &root->header;
+  const struct extent *entries = root->entries;
+  struct cache_entry *entry = NULL;
+  size_t cap = EXTENT_ROOT_CNT;
+  size_t full = 0;
+
+  for (;;)
+    {
+      int i = entry_find (entries, h->cnt, index);
+      block_sector_t child;
+      struct extent_node *node;
+
+      if (h->cnt == cap)
+        full++;
+      if (h->depth == 0 || h->cnt == 0)
+        break;
+
+      child = entries[i < 0 ? 0 : i].start;
+      if (entry != NULL)
+        cache_put (entry, CACHE_READ);
+      entry = cache_get (child, CACHE_READ, CACHE_META);
+      node = cache_data (entry, child);
+      h = &node->header;
+      entries = node->entries;
+      cap = EXTENT_NODE_CNT;
+    }
+  if (entry != NULL)
+    cache_put (entry, CACHE_READ);
+  return full;
+}
+
+/* Inserts EXT into the subtree whose root node has header H and
+   ENTRIES, with room for CAP entries.  New nodes take their sectors
+   from POOL and belong to the file whose inode is at sector
+   INUMBER.  If the node had to split, stores the entry for its new
+   right sibling in *SPLIT and returns true.
+   Each child is changed in its buffer in POOL, with no cache slot
+   held: a slot covers several sectors, so holding a parent's while
+   getting a child or a new node in the same block would wait for
+   itself. */
+static bool
+node_insert (struct extent_header *h, struct extent *entries, size_t cap,
+             const struct extent *ext, struct node_pool *pool,
+             block_sector_t inumber, struct extent *split)
+{
+  int i = entry_find (entries, h->cnt, ext->logical);
+  struct extent child_split;
+  struct extent_node *node;
+  block_sector_t child;
+  bool split_child;
+
+  if (h->depth == 0)
+    {
+      if (leaf_merge (h, entries, i, ext))
+        return false;
+      return entry_add (h, entries, cap, i + 1, ext, pool, inumber, split);
+    }
+
+  /* An extent before all the others goes to the first child, whose
+     entry then has to start no later than it. */
+  if (i < 0)
+    {
+      i = 0;
+      entries[0].logical = ext->logical;
+    }
+  child = entries[i].start;
+  node = &pool->nodes[h->depth - 1];
+  node_read (child, node);
+  split_child = node_insert (&node->header, node->entries, EXTENT_NODE_CNT,
+                             ext, pool, inumber, &child_split);
+  node_write (child, node, inumber);
+  if (!split_child)
+    return false;
+  return entry_add (h, entries, cap, i + 1, &child_split, pool, inumber,
+                    split);
+}
+
+/* Returns true if extent B starts right where extent A ends, both
+   in the file and on disk. */
+static bool
+extent_continues (const struct extent *a, const struct extent *b)
+{
+  return (a->logical + a->length == b->logical
+          && a->start + a->length == b->start);
+}
+
+/* Merges EXT into entry I of the leaf with header H and ENTRIES, or
+   into the entry after it, if EXT continues the one or is continued
+   by the other.  Filling the gap between two extents merges them
+   too.  Returns false if EXT has to take an entry of its own. */
+static bool
+leaf_merge (struct extent_header *h, struct extent *entries, int i,
+            const struct extent *ext)
+{
+  struct extent *prev = i >= 0 ? &entries[i] : NULL;
+  struct extent *next = i + 1 < h->cnt ? &entries[i + 1] : NULL;
+
+  if (prev != NULL && extent_continues (prev, ext))
+    {
+      prev->length += ext->length;
+      if (next != NULL && extent_continues (prev, next))
+        {
+          prev->length += next->length;
+          memmove (next, next + 1, (h->cnt - i - 2) * sizeof *next);
+          h->cnt--;
+        }
+      return true;
+    }
+  if (next != NULL && extent_continues (ext, next))
+    {
+      next->logical = ext->logical;
+      next->start = ext->start;
+      next->length += ext->length;
+      return true;
+    }
+  return false;
+}
+
+/* Inserts E as entry POS of the node with header H and ENTRIES,
+   with room for CAP entries.  A full node first moves its upper
+   half to a new node, taking its sector from POOL and belonging to
+   the file whose inode is at sector INUMBER; then the entry for the
+   new node is stored in *SPLIT and true is returned. */
+static bool
+entry_add (struct extent_header *h, struct extent *entries, size_t cap,
+           int pos, const struct extent *e, struct node_pool *pool,
+           block_sector_t inumber, struct extent *split)
+{
+  struct cache_entry *entry;
+  struct extent_node *node;
+  block_sector_t sector;
+  int half;
+
+  if (h->cnt < cap)
+    {
+      memmove (entries + pos + 1, entries + pos,
+               (h->cnt - pos) * sizeof *entries);
+      entries[pos] = *e;
+      h->cnt++;
+      return false;
+    }
+
+  ASSERT (cap == EXTENT_NODE_CNT && pool->cnt > 0);
+  sector = pool->sectors[--pool->cnt];
+  entry = cache_get (sector, CACHE_OVERWRITE, CACHE_META);
+  node = cache_data (entry, sector);
+  memset (node, 0, sizeof *node);
+
+  half = h->cnt / 2;
+  node->header.depth = h->depth;
+  node->header.cnt = h->cnt - half;
+  memcpy (node->entries, entries + half,
+          node->header.cnt * sizeof *entries);
+  h->cnt = half;
+  if (pos <= half)
+    entry_add (h, entries, cap, pos, e, pool, inumber, split);
+  else
+    entry_add (&node->header, node->entries, EXTENT_NODE_CNT, pos - half,
+               e, pool, inumber, split);
+
+  split->logical = node->entries[0].logical;
+  split->start = sector;
+  split->length = 0;
+  cache_set_owner (entry, inumber);
+  cache_put (entry, CACHE_OVERWRITE);
+  return true;
+}
+
+/* Reads the tree node at SECTOR into NODE. */
+static void
+node_read (block_sector_t sector, struct extent_node *node)
+{
+  struct cache_entry *entry = cache_get (sector, CACHE_READ, CACHE_META);
+
+  memcpy (node, cache_data (entry, sector), sizeof *node);
+  cache_put (entry, CACHE_READ);
+}
+
+/* Writes NODE to the tree node at SECTOR, of the file whose inode
+   is at sector INUMBER. */
+static void
+node_write (block_sector_t sector, const struct extent_node *node,
+            block_sector_t inumber)
+{
+  struct cache_entry *entry = cache_get (sector, CACHE_OVERWRITE,
+                                         CACHE_META);
+
+  memcpy (cache_data (entry, sector), node, sizeof *node);
+  cache_set_owner (entry, inumber);
+  cache_put (entry, CACHE_OVERWRITE);
+}
+
+/* Frees every sector mapped by the extent tree rooted at ROOT and
+   every node of it but the root, dropping their cached copies. */
+void
+extent_free (struct extent_root *root)
+{
+  size_t i;
+
+  for (i = 0; i < root->header.cnt; i++)
+    entry_free (&root->entries[i], root->header.depth);
+  memset (root, 0, sizeof *root);
+}
+
+/* Reads entry I of the tree node at SECTOR into *E, and the depth
+   of the node into *DEPTH.  Returns false if the node has no entry
+   I. */
+static bool
+node_entry (block_sector_t sector, size_t i, struct extent *e,
+            uint16_t *depth)
+{
+  struct cache_entry *entry = cache_get (sector, CACHE_READ, CACHE_META);
+  const struct extent_node *node = cache_data (entry, sector);
+  bool found = i < node->header.cnt;
+
+  if (found)
+    *e = node->entries[i];
+  *depth = node->header.depth;
+  cache_put (entry, CACHE_READ);
+  return found;
+}
+
+/* Frees what entry E of a node DEPTH levels above the leaves maps:
+   its sectors in a leaf, else its child node and everything below
+   it.  Nodes are read an entry at a time, so that freeing needs no
+   buffer, and cannot fail for lack of memory. */
+static void
+entry_free (const struct extent *e, uint16_t depth)
+{
+  struct extent child;
+  uint16_t child_depth;
+  size_t i;
+
+  if (depth == 0)
+    {
+      release_run (e->start, e->length);
+      return;
+    }
+  for (i = 0; node_entry (e->start, i, &child, &child_depth); i++)
+    entry_free (&child, child_depth);
+  release_run (e->start, 1);
+}
+
+/* Returns the CNT sectors starting at START to the free map,
+   dropping their cached copies so that they are never written
+   back. */
+static void
+release_run (block_sector_t start, size_t cnt)
+{
+  block_sector_t sectors[RELEASE_BATCH];
+  size_t i, j;
+
+  for (i = 0; i < cnt; i += j)
+    {
+      for (j = 0; j < RELEASE_BATCH && i + j < cnt; j++)
+        sectors[j] = start + i + j;
+      cache_invalidate (sectors, j);
+    }
+  free_map_release (start, cnt);
+}
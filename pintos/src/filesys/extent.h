@@ -0,0 +1,54 @@
+#ifndef FILESYS_EXTENT_H
+#define FILESYS_EXTENT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "devices/block.h"
+
+/* Entries in the root node of an extent tree, which is kept in the
+   inode, and in each of its other nodes, which take a sector. */
+#define EXTENT_ROOT_CNT 38
+#define EXTENT_NODE_CNT 42
+
+/* An entry of an extent tree node.  In a leaf, maps the LENGTH
+   sectors of a file starting at its sector LOGICAL to the disk
+   sectors starting at START.  In an interior node, START is the
+   child node mapping the file from its sector LOGICAL on, and
+   LENGTH is unused. */
+struct extent
+  {
+    uint32_t logical;           /* First sector within the file. */
+    block_sector_t start;       /* First disk sector, or child. */
+    uint32_t length;            /* Number of sectors. */
+  };
+
+/* Header of an extent tree node. */
+struct extent_header
+  {
+    uint16_t cnt;               /* Entries in use. */
+    uint16_t depth;             /* Levels below this node, 0 in a leaf. */
+    uint32_t unused;            /* Not used. */
+  };
+
+/* Deepest extent tree supported.  Even a tree of this depth whose
+   nodes are half full maps more extents than any disk has sectors. */
+#define EXTENT_MAX_DEPTH 4
+
+/* Most sectors a single extent_insert() allocates for new nodes. */
+#define EXTENT_INSERT_MAX (EXTENT_MAX_DEPTH + 1)
+
+/* Root node of an extent tree.  All zeros is an empty tree. */
+struct extent_root
+  {
+    struct extent_header header;
+    struct extent entries[EXTENT_ROOT_CNT];
+  };
+
+bool extent_lookup (const struct extent_root *, uint32_t, struct extent *);
+bool extent_insert (struct extent_root *, uint32_t index,
+                    block_sector_t sector, uint32_t cnt,
+                    block_sector_t inumber, size_t *reserved);
+void extent_free (struct extent_root *);
+
+#endif /* filesys/extent.h */
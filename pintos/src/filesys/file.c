@@ -1,16 +1,27 @@
 #include "filesys/file.h"
 #include <debug.h>
+#include <round.h>
 #include "filesys/inode.h"
 #include "threads/malloc.h"
 
+/* Read-ahead window limits, in sectors. */
+#define READ_AHEAD_MIN 1        /* Window on a new sequential stream. */
+#define READ_AHEAD_MAX 32       /* Largest window. */
+
 /* An open file. */
 struct file 
   {
     struct inode *inode;        /* File's inode. */
     off_t pos;                  /* Current position. */
     bool deny_write;            /* Has file_deny_write() been called? */
+    off_t ra_next;              /* Offset a sequential read starts at. */
+    off_t ra_end;               /* End of the range already prefetched. */
+    int ra_window;              /* Sectors to prefetch, 0 if random. */
+    bool direct;                /* Bypass the cache for whole sectors? */
   };
 
+static void file_read_ahead (struct file *, off_t start, off_t size);
+
 /* Opens a file for the given INODE, of which it takes ownership,
    and returns the new file.  Returns a null pointer if an
    allocation fails or if INODE is null. */
@@ -23,6 +34,10 @@ file_open (struct inode *inode)
       file->inode = inode;
       file->pos = 0;
       file->deny_write = false;
+      file->ra_next = 0;
+      file->ra_end = 0;
+      file->ra_window = 0;
+      file->direct = false;
       return file;
     }
   else
@@ -68,7 +83,7 @@ file_get_inode (struct file *file)
 off_t
 file_read (struct file *file, void *buffer, off_t size) 
 {
-  off_t bytes_read = inode_read_at (file->inode, buffer, size, file->pos);
+  off_t bytes_read = file_read_at (file, buffer, size, file->pos);
   file->pos += bytes_read;
   return bytes_read;
 }
@@ -81,7 +96,76 @@ file_read (struct file *file, void *buffer, off_t size)
 off_t
 file_read_at (struct file *file, void *buffer, off_t size, off_t file_ofs) 
 {
-  return inode_read_at (file->inode, buffer, size, file_ofs);
+  off_t bytes_read;
+
+  if (file->direct)
+    return inode_read_direct (file->inode, buffer, size, file_ofs);
+  bytes_read = inode_read_at (file->inode, buffer, size, file_ofs);
+  file_read_ahead (file, file_ofs, bytes_read);
+  return bytes_read;
+}
+
+/* Updates FILE's read-ahead window after SIZE bytes were read at
+   offset START, and prefetches past them.  A read that starts
+   where the previous one ended doubles the window, up to
+   READ_AHEAD_MAX sectors; any other read closes it, so random
+   access does not pull unwanted sectors into the cache. */
+static void
+file_read_ahead (struct file *file, off_t start, off_t size)
+{
+  off_t from, to;
+
+  if (size <= 0)
+    return;
+
+  if (start == file->ra_next)
+    {
+      file->ra_window *= 2;
+      if (file->ra_window < READ_AHEAD_MIN)
+        file->ra_window = READ_AHEAD_MIN;
+      if (file->ra_window > READ_AHEAD_MAX)
+        file->ra_window = READ_AHEAD_MAX;
+    }
+  else
+    {
+      file->ra_window = 0;
+      file->ra_end = 0;
+    }
+  file->ra_next = start + size;
+  if (file->ra_window == 0)
+    return;
+
+  /* Only ask for the part of the window not requested before. */
+  from = ROUND_UP (file->ra_next, BLOCK_SECTOR_SIZE);
+  to = from + file->ra_window * BLOCK_SECTOR_SIZE;
+  if (from < file->ra_end)
+    from = file->ra_end;
+  if (from < to)
+    {
+      inode_read_ahead (file->inode, from, (to - from) / BLOCK_SECTOR_SIZE);
+      file->ra_end = to;
+    }
+}
+
+/* Returns FILE's current read-ahead window, in sectors. */
+int
+file_read_ahead_window (struct file *file)
+{
+  ASSERT (file != NULL);
+  return file->ra_window;
+}
+
+/* Sets whether reads and writes of whole sectors of FILE go
+   straight between the caller's buffer and the disk, bypassing the
+   buffer cache, as suits large streaming transfers that would only
+   evict more useful data from it.  Read-ahead is off meanwhile. */
+void
+file_set_direct (struct file *file, bool direct)
+{
+  ASSERT (file != NULL);
+  file->direct = direct;
+  file->ra_window = 0;
+  file->ra_end = 0;
 }
 
 /* Writes SIZE bytes from BUFFER into FILE,
@@ -94,7 +178,7 @@ file_read_at (struct file *file, void *buffer, off_t size, off_t file_ofs)
 off_t
 file_write (struct file *file, const void *buffer, off_t size) 
 {
-  off_t bytes_written = inode_write_at (file->inode, buffer, size, file->pos);
+  off_t bytes_written = file_write_at (file, buffer, size, file->pos);
   file->pos += bytes_written;
   return bytes_written;
 }
@@ -110,6 +194,8 @@ off_t
 file_write_at (struct file *file, const void *buffer, off_t size,
                off_t file_ofs) 
 {
+  if (file->direct)
+    return inode_write_direct (file->inode, buffer, size, file_ofs);
   return inode_write_at (file->inode, buffer, size, file_ofs);
 }
 
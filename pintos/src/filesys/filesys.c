@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <string.h>
 #include "threads/malloc.h"
+#include "threads/synch.h"
 #include "threads/thread.h"
 #include "filesys/file.h"
 #include "filesys/free-map.h"
@@ -10,10 +11,30 @@
 #include "filesys/directory.h"
 #include "filesys/cache.h"
 
+/* Identifies the cache warm-up file. */
+#define CACHE_WARM_MAGIC 0x5741524d
+#define CACHE_WARM_MAX 256      /* Blocks recorded, at most. */
+
+/* Header of the cache warm-up file, followed by CNT `struct
+   cache_hot' records of the blocks the cache held at the last
+   shutdown, hottest first. */
+struct cache_warm_header
+  {
+    unsigned magic;             /* CACHE_WARM_MAGIC. */
+    size_t cnt;                 /* Number of records. */
+  };
+
 /* Partition that contains the file system. */
 struct block *fs_device;
 
+/* Upped when the cache warm-up thread is done with the file. */
+static struct semaphore cache_warm_done;
+
 static void do_format (void);
+static void cache_warm_create (void);
+static struct inode *cache_warm_open (struct cache_warm_header *);
+static thread_func cache_warm_thread;
+static void cache_warm_save (void);
 
 /* Initializes the file system module.
    If FORMAT is true, reformats the file system. */
@@ -30,8 +51,23 @@ filesys_init (bool format)
 
   if (format) 
     do_format ();
+  else
+    {
+      /* New inodes take the format the file system was made with. */
+      struct inode *root = inode_open (ROOT_DIR_SECTOR);
+      if (root == NULL)
+        PANIC ("can't open root directory");
+      inode_set_format (inode_get_format (root));
+      inode_close (root);
+    }
 
   free_map_open ();
+
+  sema_init (&cache_warm_done, 0);
+  if (format
+      || thread_create ("cache_warm", PRI_DEFAULT, cache_warm_thread,
+                        NULL) == TID_ERROR)
+    sema_up (&cache_warm_done);
 }
 
 /* Shuts down the file system module, writing any unwritten data
@@ -39,7 +75,12 @@ filesys_init (bool format)
 void
 filesys_done (void) 
 {
+  sema_down (&cache_warm_done);
+  cache_warm_save ();
+  inode_flush_delayed (true);
   buffer_cache_flush ();
+  cache_print_stats ();
+  inode_print_stats ();
   free_map_close ();
 }
 
@@ -172,10 +213,120 @@ do_format (void)
   free_map_create ();
   if (!dir_create (ROOT_DIR_SECTOR, 16, NULL))
     PANIC ("root directory creation failed");
+  cache_warm_create ();
   free_map_close ();
   printf ("done.\n");
 }
 
+/* Creates the cache warm-up file, with no records. */
+static void
+cache_warm_create (void)
+{
+  struct cache_warm_header header = { CACHE_WARM_MAGIC, 0 };
+  struct inode *inode;
+
+  if (!inode_create (CACHE_WARM_SECTOR, 0, false)
+      || (inode = inode_open (CACHE_WARM_SECTOR)) == NULL)
+    PANIC ("cache warm-up file creation failed");
+  inode_set_cache_class (inode, CACHE_META);
+  if (inode_write_at (inode, &header, sizeof header, 0) != sizeof header)
+    PANIC ("can't write cache warm-up file");
+  inode_close (inode);
+}
+
+/* Opens the cache warm-up file and reads its header into *HEADER.
+   Returns the file's inode, or a null pointer if it cannot be
+   opened or is not a warm-up file. */
+static struct inode *
+cache_warm_open (struct cache_warm_header *header)
+{
+  struct inode *inode = inode_open (CACHE_WARM_SECTOR);
+
+  if (inode == NULL)
+    return NULL;
+  inode_set_cache_class (inode, CACHE_META);
+  if (inode_read_at (inode, header, sizeof *header, 0) != sizeof *header
+      || header->magic != CACHE_WARM_MAGIC
+      || header->cnt > CACHE_WARM_MAX)
+    {
+      inode_close (inode);
+      return NULL;
+    }
+  return inode;
+}
+
+/* Loads the blocks recorded in the cache warm-up file at the last
+   shutdown into the cache, hottest first, so that the first
+   accesses after boot do not all wait for the disk.  Records of
+   sectors freed since then only cost a wasted read. */
+static void
+cache_warm_thread (void *aux UNUSED)
+{
+  struct cache_warm_header header;
+  struct cache_hot *hot = NULL;
+  struct inode *inode = cache_warm_open (&header);
+  block_sector_t size = block_size (fs_device);
+  size_t i;
+
+  if (inode == NULL)
+    goto done;
+  hot = malloc (header.cnt * sizeof *hot);
+  if (hot == NULL
+      || inode_read_at (inode, hot, header.cnt * sizeof *hot,
+                        sizeof header) != (off_t) (header.cnt * sizeof *hot))
+    goto done;
+
+  for (i = 0; i < header.cnt; i++)
+    {
+      block_sector_t sector = hot[i].sector;
+      int j = 0;
+
+      if (sector % CACHE_BLOCK_SECTORS != 0
+          || (hot[i].class != CACHE_DATA && hot[i].class != CACHE_META))
+        continue;
+      while (j < CACHE_BLOCK_SECTORS && sector + j < size)
+        {
+          int cnt = 0;
+
+          while (j + cnt < CACHE_BLOCK_SECTORS && sector + j + cnt < size
+                 && (hot[i].valid & (1u << (j + cnt))))
+            cnt++;
+          if (cnt > 0)
+            cache_prefetch (sector + j, cnt, hot[i].class);
+          j += cnt + 1;
+        }
+    }
+
+done:
+  free (hot);
+  inode_close (inode);
+  sema_up (&cache_warm_done);
+}
+
+/* Records the blocks the cache holds in the cache warm-up file, for
+   the next boot to load. */
+static void
+cache_warm_save (void)
+{
+  struct cache_warm_header header;
+  struct cache_hot *hot = malloc (CACHE_WARM_MAX * sizeof *hot);
+  struct inode *inode;
+  size_t cnt;
+
+  if (hot == NULL)
+    return;
+  cnt = cache_get_hot (hot, CACHE_WARM_MAX);
+  inode = cache_warm_open (&header);
+  if (inode != NULL)
+    {
+      header.cnt = cnt;
+      inode_write_at (inode, &header, sizeof header, 0);
+      inode_write_at (inode, hot, cnt * sizeof *hot, sizeof header);
+      inode_close (inode);
+    }
+  free (hot);
+}
+
 /* Creates a directory named NAME and returns TRUE if success and
    FALSE otherwise.  */
 bool
@@ -7,6 +7,7 @@
 /* Sectors of system file inodes. */
 #define FREE_MAP_SECTOR 0       /* Free map file inode sector. */
 #define ROOT_DIR_SECTOR 1       /* Root directory file inode sector. */
+#define CACHE_WARM_SECTOR 2     /* Cache warm-up file inode sector. */
 #define DEFAULT_DIR_SIZE 2  /* Number of entries in directory when
 				  created intially -- for . and .. */
 
@@ -4,9 +4,48 @@
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "threads/synch.h"
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per sector. */
+static size_t free_cnt;              /* Sectors free in the free map. */
+static size_t reserved_cnt;          /* Free sectors promised to writes. */
+
+/* Protects the free map, free_cnt and reserved_cnt, which user
+   processes and the write-behind daemon change at once.  Held
+   while the free map file is written, which never allocates. */
+static struct lock free_map_lock;
+
+/* Returns the number of free sectors not reserved. */
+static size_t
+free_map_available (void)
+{
+  return free_cnt > reserved_cnt ? free_cnt - reserved_cnt : 0;
+}
+
+/* Returns how many of CNT sectors about to be allocated come out of
+   the *RESERVED sectors reserved by the caller.  RESERVED may be a
+   null pointer, for none. */
+static size_t
+free_map_drawn (size_t cnt, const size_t *reserved)
+{
+  if (reserved == NULL)
+    return 0;
+  return cnt < *reserved ? cnt : *reserved;
+}
+
+/* Records that CNT sectors have been allocated, DRAWN of them out
+   of the *RESERVED sectors reserved by the caller. */
+static void
+free_map_take (size_t cnt, size_t drawn, size_t *reserved)
+{
+  free_cnt -= cnt;
+  if (drawn > 0)
+    {
+      reserved_cnt = reserved_cnt > drawn ? reserved_cnt - drawn : 0;
+      *reserved -= drawn;
+    }
+}
 
 /* Initializes the free map. */
 void
@@ -17,17 +56,37 @@ free_map_init (void)
     PANIC ("bitmap creation failed--file system device is too large");
   bitmap_mark (free_map, FREE_MAP_SECTOR);
   bitmap_mark (free_map, ROOT_DIR_SECTOR);
+  bitmap_mark (free_map, CACHE_WARM_SECTOR);
+  free_cnt = bitmap_count (free_map, 0, bitmap_size (free_map), false);
+  lock_init (&free_map_lock);
 }
 
 /* Allocates CNT consecutive sectors from the free map and stores
    the first into *SECTORP.
    Returns true if successful, false if not enough consecutive
-   sectors were available or if the free_map file could not be
-   written. */
+   sectors were available, besides those reserved, or if the
+   free_map file could not be written. */
 bool
 free_map_allocate (size_t cnt, block_sector_t *sectorp)
 {
-  block_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
+  return free_map_allocate_reserved (cnt, sectorp, NULL);
+}
+
+/* Like free_map_allocate(), but the sectors come out of the
+   *RESERVED sectors the caller reserved with free_map_reserve(), as
+   far as they go, which are deducted from *RESERVED.  RESERVED may
+   be a null pointer. */
+bool
+free_map_allocate_reserved (size_t cnt, block_sector_t *sectorp,
+                            size_t *reserved)
+{
+  block_sector_t sector = BITMAP_ERROR;
+  size_t drawn;
+
+  lock_acquire (&free_map_lock);
+  drawn = free_map_drawn (cnt, reserved);
+  if (cnt - drawn <= free_map_available ())
+    sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
   if (sector != BITMAP_ERROR
       && free_map_file != NULL
       && !bitmap_write (free_map, free_map_file))
@@ -36,17 +95,86 @@ free_map_allocate (size_t cnt, block_sector_t *sectorp)
       sector = BITMAP_ERROR;
     }
   if (sector != BITMAP_ERROR)
-    *sectorp = sector;
+    {
+      free_map_take (cnt, drawn, reserved);
+      *sectorp = sector;
+    }
+  lock_release (&free_map_lock);
   return sector != BITMAP_ERROR;
 }
 
+/* Allocates as many of the CNT sectors starting at SECTOR as are
+   free in a row, up to the first one in use, and returns how many
+   it allocated.  Used to extend a run of sectors in place.  The
+   sectors come out of the *RESERVED sectors reserved by the caller
+   first, unless RESERVED is a null pointer, as with
+   free_map_allocate_reserved(). */
+size_t
+free_map_extend (block_sector_t sector, size_t cnt, size_t *reserved)
+{
+  size_t n = 0;
+  size_t limit;
+
+  lock_acquire (&free_map_lock);
+  limit = free_map_available () + free_map_drawn (cnt, reserved);
+  if (cnt > limit)
+    cnt = limit;
+  while (n < cnt && sector + n < bitmap_size (free_map)
+         && !bitmap_test (free_map, sector + n))
+    n++;
+  if (n > 0)
+    {
+      bitmap_set_multiple (free_map, sector, n, true);
+      if (free_map_file != NULL && !bitmap_write (free_map, free_map_file))
+        {
+          bitmap_set_multiple (free_map, sector, n, false);
+          n = 0;
+        }
+      else
+        free_map_take (n, free_map_drawn (n, reserved), reserved);
+    }
+  lock_release (&free_map_lock);
+  return n;
+}
+
+/* Reserves CNT free sectors for data whose sectors are allocated
+   later, so that other allocations cannot take them meanwhile.
+   Returns false if fewer than CNT sectors are free. */
+bool
+free_map_reserve (size_t cnt)
+{
+  bool success = false;
+
+  lock_acquire (&free_map_lock);
+  if (cnt <= free_map_available ())
+    {
+      reserved_cnt += cnt;
+      success = true;
+    }
+  lock_release (&free_map_lock);
+  return success;
+}
+
+/* Gives back CNT sectors reserved with free_map_reserve(), about
+   to be allocated or no longer needed. */
+void
+free_map_unreserve (size_t cnt)
+{
+  lock_acquire (&free_map_lock);
+  reserved_cnt = reserved_cnt > cnt ? reserved_cnt - cnt : 0;
+  lock_release (&free_map_lock);
+}
+
 /* Makes CNT sectors starting at SECTOR available for use. */
 void
 free_map_release (block_sector_t sector, size_t cnt)
 {
+  lock_acquire (&free_map_lock);
   ASSERT (bitmap_all (free_map, sector, cnt));
   bitmap_set_multiple (free_map, sector, cnt, false);
+  free_cnt += cnt;
   bitmap_write (free_map, free_map_file);
+  lock_release (&free_map_lock);
 }
 
 /* Opens the free map file and reads it from disk. */
@@ -56,8 +184,10 @@ free_map_open (void)
   free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
   if (free_map_file == NULL)
     PANIC ("can't open free map");
+  inode_set_cache_class (file_get_inode (free_map_file), CACHE_META);
   if (!bitmap_read (free_map, free_map_file))
     PANIC ("can't read free map");
+  free_cnt = bitmap_count (free_map, 0, bitmap_size (free_map), false);
 }
 
 /* Writes the free map to disk and closes the free map file. */
@@ -72,14 +202,24 @@ free_map_close (void)
 void
 free_map_create (void) 
 {
+  struct file *file;
+
   /* Create inode. */
   if (!inode_create (FREE_MAP_SECTOR, bitmap_file_size (free_map), false))
     PANIC ("free map creation failed");
 
-  /* Write bitmap to file. */
-  free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
-  if (free_map_file == NULL)
+  /* Write bitmap to file.  The new file is a hole, so the first
+     write waits in the inode until its sectors are allocated, which
+     changes the free map again; only the second write records
+     them.  Writing the free map must never allocate. */
+  file = file_open (inode_open (FREE_MAP_SECTOR));
+  if (file == NULL)
     PANIC ("can't open free map");
+  inode_set_cache_class (file_get_inode (file), CACHE_META);
+  if (!bitmap_write (free_map, file))
+    PANIC ("can't write free map");
+  inode_flush_delayed (true);
+  free_map_file = file;
   if (!bitmap_write (free_map, free_map_file))
     PANIC ("can't write free map");
 }
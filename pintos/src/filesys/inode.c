@@ -1,21 +1,30 @@
 #include "filesys/inode.h"
+#include <hash.h>
 #include <list.h>
 #include <debug.h>
 #include <round.h>
+#include <stdio.h>
 #include <string.h>
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
 #include "filesys/cache.h"
+#include "filesys/extent.h"
 #include "threads/malloc.h"
 #include "threads/thread.h"
 
-/* Identifies an inode. */
+/* Identifies an inode, mapping its data with pointers or with an
+   extent tree. */
 #define INODE_MAGIC 0x494e4f44
+#define INODE_EXTENT_MAGIC 0x494e4f45
 #define MAX_SECTOR_INDEX 128
 #define NO_SECTOR UINT_MAX
-
-static char zeros[BLOCK_SECTOR_SIZE];
-static block_sector_t next_di;
+#define HOLE_SECTOR 0           /* Unallocated sector, reads as zeros. */
+#define READ_AHEAD_QUEUE_SIZE 16 /* Pending read-ahead requests. */
+#define DIRECT_RUN_MAX 128      /* Sectors per direct device request. */
+#define INODE_INLINE_MAX 472    /* Largest file kept inside its inode. */
+#define DELAY_MAX_SECTORS 64    /* Delayed sectors kept per inode. */
+#define DELAY_TOTAL_MAX 256     /* Delayed sectors kept in all. */
+#define CLOSED_INODES_MAX 64    /* Closed inodes kept in memory. */
 
 /* On-disk inode.
    Must be exactly BLOCK_SECTOR_SIZE bytes long. */
@@ -27,10 +36,18 @@ struct inode_disk
     enum pointer pointer;
     off_t length;                       /* File size in bytes. */
     bool is_directory;			/* Is this file a directory? */
+    bool is_inline;                     /* Data kept in DATA below? */
     unsigned magic;                     /* Magic number. */
-    uint32_t unused[118];               /* Not used. */
+    union
+      {
+        struct extent_root extents;     /* Extent tree, extent format. */
+        uint8_t data[INODE_INLINE_MAX]; /* Contents of an inline file. */
+      };
   };
 
+/* Format of the inodes created. */
+static enum inode_format inode_format = INODE_INDEXED;
+
 /* Returns the number of sectors to allocate for an inode SIZE
    bytes long. */
 static inline size_t
@@ -42,7 +59,8 @@ bytes_to_sectors (off_t size)
 /* In-memory inode. */
 struct inode 
   {
-    struct list_elem elem;              /* Element in inode list. */
+    struct hash_elem elem;              /* Element in open_inodes. */
+    struct list_elem closed_elem;       /* In closed_inodes if closed. */
     block_sector_t sector;              /* Sector number of disk location. */
     int open_cnt;                       /* Number of openers. */
     bool removed;                       /* True if deleted, false otherwise. */
@@ -51,16 +69,99 @@ struct inode
     struct indirect indirect;
     struct d_indirect d_indirect;
     bool is_directory;
+    bool is_inline;                     /* Data kept in the inode sector? */
+    enum cache_class cache_class;       /* Class of its data in the cache. */
     off_t length;    			/* Length of file stored at this inode */
     struct lock growth_lock;
+
+    /* Memo of the index blocks used last, so that sequential access
+       translates offsets without a cache lookup.  Protected by
+       memo_lock. */
+    struct lock memo_lock;
+    block_sector_t memo_sector;         /* Index block in MEMO. */
+    block_sector_t *memo;               /* Its entries, or null. */
+    off_t memo_dindex;                  /* Double-indirect entry... */
+    block_sector_t memo_dsector;        /* ...and its value. */
+
+    /* Extent format only: the root of the extent tree, and the
+       extent used last.  Protected by memo_lock. */
+    struct extent_root *extents;        /* Null for the indexed format. */
+    struct extent memo_extent;
+
+    /* Data written to holes, waiting for sectors to be allocated
+       when it is written back.  Protected by growth_lock. */
+    struct list delayed;                /* Sorted by file sector. */
+    size_t delayed_cnt;                 /* Number of delayed sectors. */
+    size_t delayed_reserved;            /* Free map sectors reserved. */
+    struct list_elem delayed_elem;      /* In delayed_inodes. */
+    bool delayed_listed;                /* In delayed_inodes? */
+  };
+
+/* A sector of data written to a hole of a file, whose disk sector
+   is not allocated yet.  Its space is reserved in the free map. */
+struct delayed_sector
+  {
+    struct list_elem elem;              /* In the inode's delayed list. */
+    off_t index;                        /* Sector within the file. */
+    uint8_t data[BLOCK_SECTOR_SIZE];
   };
 
+/* Inodes that may have delayed sectors, for the write-behind daemon
+   to allocate, and the lock protecting the list and the inodes'
+   places in it. */
+static struct list delayed_inodes;
+static struct lock delayed_lock;
+
+/* Delayed sectors of all inodes, kept under DELAY_TOTAL_MAX, and
+   the lock protecting the count. */
+static size_t delayed_total;
+static struct lock delayed_total_lock;
+
+/* A read-ahead request: prefetch SECTORS sectors of INODE starting
+   at byte OFFSET.  Holds an opener reference to INODE. */
 struct read_ahead_struct {
      struct inode *inode;
      off_t offset;
+     int sectors;
 };
 
-thread_func inode_read_ahead;
+/* Bounded ring of pending read-ahead requests, served by the
+   read-ahead daemon.  Requests that do not fit are dropped. */
+static struct read_ahead_struct read_ahead_queue[READ_AHEAD_QUEUE_SIZE];
+static size_t read_ahead_head;          /* Index of oldest request. */
+static size_t read_ahead_cnt;           /* Number of queued requests. */
+static struct lock read_ahead_lock;
+static struct condition read_ahead_ready;
+
+/* Read-ahead statistics, protected by read_ahead_lock. */
+static unsigned long long read_ahead_requests;  /* Requests queued. */
+static unsigned long long read_ahead_sectors;   /* Sectors requested. */
+static unsigned long long read_ahead_dropped;   /* Requests dropped. */
+
+thread_func read_ahead_daemon;
+
+/* Reads the metadata sector SECTOR, an inode or an index block,
+   into BUFFER through the cache. */
+static void
+meta_read (block_sector_t sector, void *buffer)
+{
+  struct cache_entry *entry = cache_get (sector, CACHE_READ, CACHE_META);
+  memcpy (buffer, cache_data (entry, sector), BLOCK_SECTOR_SIZE);
+  cache_put (entry, CACHE_READ);
+}
+
+/* Writes BUFFER to the metadata sector SECTOR of the file whose
+   inode is at sector INUMBER, through the cache. */
+static void
+meta_write (block_sector_t sector, const void *buffer,
+            block_sector_t inumber)
+{
+  struct cache_entry *entry = cache_get (sector, CACHE_OVERWRITE,
+                                         CACHE_META);
+  memcpy (cache_data (entry, sector), buffer, BLOCK_SECTOR_SIZE);
+  cache_set_owner (entry, inumber);
+  cache_put (entry, CACHE_OVERWRITE);
+}
 
 /* Given a sector SECTOR and and index INDEX into the SECTOR,
    it returns the sector number stored at that INDEX.
@@ -69,20 +170,109 @@ thread_func inode_read_ahead;
 static block_sector_t
 sector_at_index (block_sector_t sector, off_t index)
 {
+  struct cache_entry *entry = cache_get (sector, CACHE_READ, CACHE_META);
   block_sector_t indirect_sector;
-  block_sector_t *buffer = calloc (1, BLOCK_SECTOR_SIZE); 
-  block_read (fs_device, sector, buffer);
-  buffer += index;
-  memcpy (&indirect_sector, buffer, sizeof (block_sector_t));
+
+  indirect_sector = ((block_sector_t *) cache_data (entry, sector))[index];
+  cache_put (entry, CACHE_READ);
   return indirect_sector;
 }
 
+/* Like sector_at_index(), for INODE, but serves the lookup from
+   INODE's memo, after copying the index block at SECTOR into it if
+   it holds another one.  Falls back to the cache if the memo cannot
+   be allocated.  Must be called with INODE's memo_lock held. */
+static block_sector_t
+memo_at_index (struct inode *inode, block_sector_t sector, off_t index)
+{
+  if (inode->memo_sector != sector)
+    {
+      if (inode->memo == NULL
+          && (inode->memo = malloc (BLOCK_SECTOR_SIZE)) == NULL)
+        return sector_at_index (sector, index);
+      meta_read (sector, inode->memo);
+      inode->memo_sector = sector;
+    }
+  return inode->memo[index];
+}
+
+/* Forgets the index blocks memoized in INODE, whose index blocks
+   are about to change. */
+static void
+memo_clear (struct inode *inode)
+{
+  lock_acquire (&inode->memo_lock);
+  inode->memo_sector = NO_SECTOR;
+  inode->memo_dindex = -1;
+  inode->memo_extent.length = 0;
+  lock_release (&inode->memo_lock);
+}
+
+static block_sector_t byte_to_sector (struct inode *, off_t);
+
+/* Returns the number of sectors of INODE, up to MAX, starting with
+   SECTOR, the allocated one holding byte offset POS, that are
+   consecutive on disk and within one cache block, so that they can
+   be transferred with one cache lookup and one device request. */
+static int
+sector_run (struct inode *inode, off_t pos, block_sector_t sector,
+            int max)
+{
+  int cnt = 1;
+
+  while (cnt < max
+         && (sector + cnt) % CACHE_BLOCK_SECTORS != 0
+         && byte_to_sector (inode, pos + cnt * BLOCK_SECTOR_SIZE)
+            == sector + cnt)
+    cnt++;
+  return cnt;
+}
+
+/* Returns the number of sectors of INODE, up to MAX, starting with
+   SECTOR, the allocated one holding byte offset POS, that are
+   consecutive on disk, so that they can be transferred with one
+   device request. */
+static int
+device_run (struct inode *inode, off_t pos, block_sector_t sector,
+            int max)
+{
+  int cnt = 1;
+
+  while (cnt < max
+         && byte_to_sector (inode, pos + cnt * BLOCK_SECTOR_SIZE)
+            == sector + cnt)
+    cnt++;
+  return cnt;
+}
+
+/* Returns the disk sector holding sector INDEX of INODE, which
+   uses the extent format, or HOLE_SECTOR if there is none.  A lookup
+   in the extent tree is only needed when INDEX falls outside the
+   extent used last. */
+static block_sector_t
+extent_to_sector (struct inode *inode, uint32_t index)
+{
+  struct extent *memo = &inode->memo_extent;
+  block_sector_t sector = HOLE_SECTOR;
+
+  lock_acquire (&inode->memo_lock);
+  if (index - memo->logical < memo->length
+      || extent_lookup (inode->extents, index, memo))
+    sector = memo->start + (index - memo->logical);
+  lock_release (&inode->memo_lock);
+  return sector;
+}
+
 /* Returns the block device sector that contains byte offset POS
    within INODE.
-   Returns -1 if INODE does not contain data at offset POS. */
+   Returns HOLE_SECTOR if no sector has been allocated there yet,
+   which is always the case for inline data, or NO_SECTOR if INODE
+   does not contain data at offset POS. */
 static block_sector_t
-byte_to_sector (const struct inode *inode, off_t pos) 
+byte_to_sector (struct inode *inode, off_t pos) 
 {
+  block_sector_t sector;
+
   ASSERT (inode != NULL);
 
   if (pos > inode->length)
@@ -90,48 +280,121 @@ byte_to_sector (const struct inode *inode, off_t pos)
   
   off_t sector_index = pos / BLOCK_SECTOR_SIZE;
   
+  if (inode->extents != NULL)
+    return extent_to_sector (inode, sector_index);
+
   if (sector_index == 0)
    {
      return inode->direct;
    }
-  else if (sector_index > 0 && sector_index <= MAX_SECTOR_INDEX)
+
+  lock_acquire (&inode->memo_lock);
+  if (sector_index > 0 && sector_index <= MAX_SECTOR_INDEX)
    {
      sector_index -= 1;
-     return sector_at_index (inode->indirect.sector, sector_index);
+     sector = HOLE_SECTOR;
+     if (inode->indirect.sector != HOLE_SECTOR)
+       sector = memo_at_index (inode, inode->indirect.sector, sector_index);
    }
   else
    {
      sector_index -= (MAX_SECTOR_INDEX + 1);
      off_t d_indirect_index = sector_index / MAX_SECTOR_INDEX;
-     block_sector_t tmp = sector_at_index (inode->d_indirect.sector,
-					   d_indirect_index);
+     if (inode->memo_dindex != d_indirect_index)
+      {
+        inode->memo_dsector = HOLE_SECTOR;
+        if (inode->d_indirect.sector != HOLE_SECTOR)
+          inode->memo_dsector = sector_at_index (inode->d_indirect.sector,
+                                                 d_indirect_index);
+        inode->memo_dindex = d_indirect_index;
+      }
      off_t indirect_index = sector_index % MAX_SECTOR_INDEX;
-    return sector_at_index (tmp, indirect_index);
+     sector = HOLE_SECTOR;
+     if (inode->memo_dsector != HOLE_SECTOR)
+       sector = memo_at_index (inode, inode->memo_dsector, indirect_index);
    }
+  lock_release (&inode->memo_lock);
+  return sector;
+}
+
+
+/* Returns the CNT sectors in SECTORS to the free map, dropping
+   any cached copies first so that data written to them but not yet
+   flushed is never written back. */
+static void
+release_sectors (const block_sector_t *sectors, size_t cnt)
+{
+  size_t i;
+
+  cache_invalidate (sectors, cnt);
+  for (i = 0; i < cnt; i++)
+    free_map_release (sectors[i], 1);
 }
 
+/* Returns the sectors recorded in the index block whose entries
+   are in ENTRIES to the free map, skipping holes.  Reorders
+   ENTRIES. */
+static void
+release_index (block_sector_t *entries)
+{
+  size_t cnt = 0;
+  size_t i;
+
+  for (i = 0; i < MAX_SECTOR_INDEX; i++)
+    if (entries[i] != HOLE_SECTOR)
+      entries[cnt++] = entries[i];
+  release_sectors (entries, cnt);
+}
 
-/* List of open inodes, so that opening a single inode twice
-   returns the same `struct inode'. */
-static struct list open_inodes;
+/* Open inodes, indexed by sector, so that opening a single inode
+   twice returns the same `struct inode'.  Inodes closed by their
+   last opener, unless removed, stay in the table with no openers,
+   so that opening them again needs no disk read, and join
+   closed_inodes, most recently closed first, until CLOSED_INODES_MAX
+   newer ones push them out.  open_inodes_lock protects the table,
+   closed_inodes and the inodes' open_cnt. */
+static struct hash open_inodes;
+static struct list closed_inodes;
+static size_t closed_cnt;
+static struct lock open_inodes_lock;
+
+static hash_hash_func inode_hash;
+static hash_less_func inode_less;
+static struct inode *open_inode_find (block_sector_t);
+static void open_inode_get (struct inode *);
+static void inode_free (struct inode *);
 
 /* Initializes the inode module. */
 void
 inode_init (void) 
 {
-  list_init (&open_inodes);
+  hash_init (&open_inodes, inode_hash, inode_less, NULL);
+  list_init (&closed_inodes);
+  closed_cnt = 0;
+  lock_init (&open_inodes_lock);
+  list_init (&delayed_inodes);
+  lock_init (&delayed_lock);
+  delayed_total = 0;
+  lock_init (&delayed_total_lock);
+
+  lock_init (&read_ahead_lock);
+  cond_init (&read_ahead_ready);
+  read_ahead_head = read_ahead_cnt = 0;
+  if (thread_create ("read_ahead_daemon", PRI_DEFAULT,
+		     read_ahead_daemon, NULL) == TID_ERROR)
+    PANIC ("Cannot create read-ahead daemon!");
 }
 
 /* Initializes an inode with LENGTH bytes of data and
    writes the new inode to sector SECTOR on the file system
-   device.
+   device.  The data is a hole, which takes no sectors until it is
+   written, so that creating a file is quick whatever its length.
    Returns true if successful.
-   Returns false if memory or disk allocation fails. */
+   Returns false if memory allocation fails. */
 bool
 inode_create (block_sector_t sector, off_t length, bool directory)
 {
   struct inode_disk *disk_inode = NULL;
-  bool success = false;
 
   ASSERT (length >= 0);
 
@@ -140,137 +403,549 @@ inode_create (block_sector_t sector, off_t length, bool directory)
   ASSERT (sizeof *disk_inode == BLOCK_SECTOR_SIZE);
 
   disk_inode = calloc (1, sizeof *disk_inode);
-  if (disk_inode != NULL)
-    {
-      int rem_sectors = bytes_to_sectors (length);
-      disk_inode->length = length;
-      disk_inode->magic = INODE_MAGIC;
-      disk_inode->pointer = NONE;
-      disk_inode->is_directory = directory;
-
-     /* If length is zero, just create the inode and return */
-     if (rem_sectors == 0)
-	{
-	  success = true;
-          goto done;
-	}
-
-      /* Allocate direct pointer */
-      success = free_map_allocate (1, &disk_inode->direct);
-      if (!success)
-         goto done;
-      block_write (fs_device, disk_inode->direct, zeros);
-      rem_sectors--;
-      if (rem_sectors == 0)
-       {
-         disk_inode->pointer = DIRECT;
-         goto done;
-       }
-
-      /* Allocate indirect pointer */
-      if(!free_map_allocate (1, &disk_inode->indirect.sector))
-         goto done;
-      rem_sectors = inode_allocate_indirect (&disk_inode->indirect, rem_sectors);
-      if (rem_sectors == -1)
-        {
-	  success = false;
-	  goto done;
-	}
-      else if (rem_sectors == 0)
-	{
-          disk_inode->pointer = INDIRECT;
-          goto done;
-        }
-     
-       /* Allocate Double indirect pointer */
-       if(!free_map_allocate (1, &disk_inode->d_indirect.sector))
-         goto done; 
-       rem_sectors = inode_allocate_double_indirect
-		                  (&disk_inode->d_indirect, rem_sectors);
-      if (rem_sectors == -1)
+  if (disk_inode == NULL)
+    return false;
+
+  disk_inode->length = length;
+  disk_inode->magic = INODE_MAGIC;
+  disk_inode->is_directory = directory;
+  if (inode_format == INODE_EXTENTS)
+    disk_inode->magic = INODE_EXTENT_MAGIC;
+
+  /* Small files are kept in the inode sector, already zeroed. */
+  if (length <= INODE_INLINE_MAX)
+    disk_inode->is_inline = true;
+
+  meta_write (sector, disk_inode, sector);
+  free (disk_inode);
+  return true;
+}
+
+/* Allocates a new index block for the file whose inode is at
+   sector INUMBER, with every entry a hole, and stores its sector
+   in *SECTORP.  The sector comes out of the *RESERVED sectors
+   reserved by the caller, if any (see free_map_allocate_reserved()).
+   Returns false if the disk is full. */
+static bool
+index_block_create (block_sector_t *sectorp, block_sector_t inumber,
+                    size_t *reserved)
+{
+  struct cache_entry *entry;
+
+  if (!free_map_allocate_reserved (1, sectorp, reserved))
+    return false;
+  entry = cache_get (*sectorp, CACHE_OVERWRITE, CACHE_META);
+  memset (cache_data (entry, *sectorp), 0, BLOCK_SECTOR_SIZE);
+  cache_set_owner (entry, inumber);
+  cache_put (entry, CACHE_OVERWRITE);
+  return true;
+}
+
+/* Stores SECTOR as entry INDEX of the index block at sector BLOCK,
+   of the file whose inode is at sector INUMBER. */
+static void
+index_block_set (block_sector_t block, off_t index, block_sector_t sector,
+                 block_sector_t inumber)
+{
+  struct cache_entry *entry = cache_get (block, CACHE_WRITE, CACHE_META);
+
+  ((block_sector_t *) cache_data (entry, block))[index] = sector;
+  cache_set_owner (entry, inumber);
+  cache_put (entry, CACHE_WRITE);
+}
+
+/* Maps sector INDEX of INODE, which uses the indexed format, to
+   disk sector SECTOR, allocating the index blocks on the way that
+   are still holes, out of the *RESERVED sectors reserved by the
+   caller, if any.  Returns false if the disk is full. */
+static bool
+map_indexed (struct inode *inode, off_t index, block_sector_t sector,
+             size_t *reserved)
+{
+  struct inode_disk *disk_inode = malloc (sizeof *disk_inode);
+  block_sector_t block;
+  bool success = false;
+
+  if (disk_inode == NULL)
+    return false;
+  meta_read (inode->sector, disk_inode);
+
+  if (index == 0)
+    disk_inode->direct = sector;
+  else if (index <= MAX_SECTOR_INDEX)
+    {
+      if (disk_inode->indirect.sector == HOLE_SECTOR
+          && !index_block_create (&disk_inode->indirect.sector,
+                                  inode->sector, reserved))
+        goto done;
+      index_block_set (disk_inode->indirect.sector, index - 1, sector,
+                       inode->sector);
+    }
+  else
+    {
+      index -= MAX_SECTOR_INDEX + 1;
+      if (disk_inode->d_indirect.sector == HOLE_SECTOR
+          && !index_block_create (&disk_inode->d_indirect.sector,
+                                  inode->sector, reserved))
+        goto done;
+      block = sector_at_index (disk_inode->d_indirect.sector,
+                               index / MAX_SECTOR_INDEX);
+      if (block == HOLE_SECTOR)
         {
-	  success = false;
-	  goto done;
-	}
-      else if (rem_sectors == 0)
-	{
-          disk_inode->pointer = DOUBLE_INDIRECT;
-          goto done;
+          if (!index_block_create (&block, inode->sector, reserved))
+            goto done;
+          index_block_set (disk_inode->d_indirect.sector,
+                           index / MAX_SECTOR_INDEX, block, inode->sector);
         }
+      index_block_set (block, index % MAX_SECTOR_INDEX, sector,
+                       inode->sector);
     }
+  success = true;
 
 done:
+  /* Index blocks allocated before running out of space stay, empty. */
+  meta_write (inode->sector, disk_inode, inode->sector);
+  inode->direct = disk_inode->direct;
+  inode->indirect = disk_inode->indirect;
+  inode->d_indirect = disk_inode->d_indirect;
+  memo_clear (inode);
+  free (disk_inode);
+  return success;
+}
+
+/* Maps the CNT sectors of INODE starting at INDEX, which uses the
+   extent format, to the disk sectors starting at SECTOR, allocating
+   tree nodes out of the *RESERVED sectors reserved by the caller,
+   if any.  Returns false if the disk is full. */
+static bool
+map_extent (struct inode *inode, off_t index, block_sector_t sector,
+            size_t cnt, size_t *reserved)
+{
+  struct inode_disk *disk_inode = malloc (sizeof *disk_inode);
+  bool success;
+
+  if (disk_inode == NULL)
+    return false;
+  lock_acquire (&inode->memo_lock);
+  success = extent_insert (inode->extents, index, sector, cnt,
+                           inode->sector, reserved);
+  inode->memo_extent.length = 0;
+  lock_release (&inode->memo_lock);
   if (success)
     {
-     block_write (fs_device, sector, disk_inode);  
+      meta_read (inode->sector, disk_inode);
+      disk_inode->extents = *inode->extents;
+      meta_write (inode->sector, disk_inode, inode->sector);
     }
   free (disk_inode);
   return success;
 }
 
-/* Allocates sectors for indirect pointers for a file
-   Returns -1 if allocation fails. 
-   Else, returns the number of sectors remaining that
-   need to be allocated.  */
-int
-inode_allocate_indirect (struct indirect *indirect, int sectors_left)
+/* Allocates up to CNT consecutive disk sectors for the sectors of
+   INODE starting at INDEX, which are holes, out of the *RESERVED
+   sectors reserved by the caller as far as they go, and stores the
+   first in *START.  The sectors right after the one holding sector
+   INDEX - 1 of the file are taken if they are free, so that files
+   written in order stay consecutive on disk; else the longest run
+   the free map has, halving CNT until one fits.  Returns the number
+   of sectors allocated, 0 if the disk is full. */
+static size_t
+allocate_run (struct inode *inode, off_t index, size_t cnt,
+              block_sector_t *start, size_t *reserved)
 {
-  block_sector_t *buffer = malloc (BLOCK_SECTOR_SIZE);
+  block_sector_t prev = HOLE_SECTOR;
+  size_t got = 0;
 
-  block_read (fs_device, indirect->sector, buffer);
-  while (indirect->offset < MAX_SECTOR_INDEX)
+  if (index > 0)
+    prev = byte_to_sector (inode, (index - 1) * BLOCK_SECTOR_SIZE);
+  if (prev != HOLE_SECTOR)
     {
-      if (!free_map_allocate (1, (buffer + indirect->offset)))
-       {
-        free (buffer);
-	return -1;
-       }
-      block_write (fs_device, *(buffer + indirect->offset), zeros);
-      sectors_left--;
-      indirect->offset++;
-      if (sectors_left == 0)
-         break;
+      *start = prev + 1;
+      got = free_map_extend (*start, cnt, reserved);
     }
-  block_write (fs_device, indirect->sector, buffer);
-  free (buffer);
-  return sectors_left;
+  if (got == 0)
+    for (got = cnt; got > 0; got /= 2)
+      if (free_map_allocate_reserved (got, start, reserved))
+        break;
+  return got;
 }
 
-int 
-inode_allocate_double_indirect (struct d_indirect *d_indirect,
-				int sectors_left)
+/* Maps the CNT disk sectors starting at START, from allocate_run(),
+   to the sectors of INODE starting at INDEX, allocating index blocks
+   out of *RESERVED as allocate_run() does.  Returns the number of
+   sectors mapped; the others, which found no room, are freed. */
+static size_t
+map_run (struct inode *inode, off_t index, block_sector_t start,
+         size_t cnt, size_t *reserved)
 {
-  int j;
-  block_sector_t *buffer = malloc (BLOCK_SECTOR_SIZE);
-  struct indirect indirect;
+  size_t mapped = 0;
 
-  block_read (fs_device, d_indirect->sector, buffer);
-  for (j = d_indirect->off1; j < MAX_SECTOR_INDEX; j++)
-   {
-    if (next_di == 0 || ((block_sector_t)j == next_di)) {
-    if (!free_map_allocate (1, (buffer + j)))
-     {
-       sectors_left = -1;
-       goto done;
-     }
-    }
-     indirect.sector = *(buffer + j);
-     indirect.offset = d_indirect->off2;
-     sectors_left = inode_allocate_indirect (&indirect, sectors_left);
-     d_indirect->off1 = j;
-     d_indirect->off2 = indirect.offset;
-     next_di = j+1;
-     if (sectors_left == -1)
-        goto done;
-     if (sectors_left == 0)
+  if (inode->extents != NULL)
+    mapped = map_extent (inode, index, start, cnt, reserved) ? cnt : 0;
+  else
+    while (mapped < cnt
+           && map_indexed (inode, index + mapped, start + mapped, reserved))
+      mapped++;
+  for (; mapped < cnt; cnt--)
+    {
+      block_sector_t sector = start + cnt - 1;
+      release_sectors (&sector, 1);
+    }
+  return mapped;
+}
+
+/* Allocates a sector for byte offset POS of INODE, which is in a
+   hole, fills it with zeros in the cache and maps it, and returns
+   it.  Returns the sector already there if another writer filled
+   the hole first, or HOLE_SECTOR if the disk is full.  Must be
+   called with INODE's growth_lock held. */
+static block_sector_t
+inode_allocate_sector (struct inode *inode, off_t pos)
+{
+  off_t index = pos / BLOCK_SECTOR_SIZE;
+  block_sector_t sector = byte_to_sector (inode, pos);
+
+  if (sector != HOLE_SECTOR)
+    return sector;
+  if (allocate_run (inode, index, 1, &sector, NULL) == 0)
+    return HOLE_SECTOR;
+  cache_zero (sector, inode->sector);
+  if (map_run (inode, index, sector, 1, NULL) == 0)
+    return HOLE_SECTOR;
+  return sector;
+}
+
+/* Returns the delayed sector of INODE for file sector INDEX, or a
+   null pointer if there is none.  Must be called with INODE's
+   growth_lock held. */
+static struct delayed_sector *
+delayed_find (struct inode *inode, off_t index)
+{
+  struct list_elem *e;
+
+  for (e = list_begin (&inode->delayed); e != list_end (&inode->delayed);
+       e = list_next (e))
+    {
+      struct delayed_sector *d = list_entry (e, struct delayed_sector, elem);
+      if (d->index >= index)
+        return d->index == index ? d : NULL;
+    }
+  return NULL;
+}
+
+/* Returns true if INODE has delayed data for a file sector from
+   FIRST to LAST, both included.  Must be called with INODE's
+   growth_lock held. */
+static bool
+delayed_in (struct inode *inode, off_t first, off_t last)
+{
+  struct list_elem *e;
+
+  for (e = list_begin (&inode->delayed); e != list_end (&inode->delayed);
+       e = list_next (e))
+    {
+      struct delayed_sector *d = list_entry (e, struct delayed_sector, elem);
+      if (d->index >= first)
+        return d->index <= last;
+    }
+  return false;
+}
+
+/* Returns the number of sectors to reserve for sector INDEX of
+   INODE, about to be delayed, so that delayed data always finds
+   room when it is written back: the sector itself, and each index
+   block mapping it that is still a hole, unless another delayed
+   sector mapped by the same block reserved it already.  With the
+   extent format, the tree nodes an insertion may split are
+   reserved once per run of consecutive delayed sectors.  Must be
+   called with INODE's growth_lock held. */
+static size_t
+delayed_need (struct inode *inode, off_t index)
+{
+  off_t group, first;
+  block_sector_t block = HOLE_SECTOR;
+  size_t need = 1;
+
+  if (inode->extents != NULL)
+    {
+      if (index == 0 || delayed_find (inode, index - 1) == NULL)
+        need += EXTENT_INSERT_MAX;
+      return need;
+    }
+  if (index == 0)
+    return need;
+  if (index <= MAX_SECTOR_INDEX)
+    {
+      if (inode->indirect.sector == HOLE_SECTOR
+          && !delayed_in (inode, 1, MAX_SECTOR_INDEX))
+        need++;
+      return need;
+    }
+
+  /* Index blocks mapped by the doubly indirect block hold
+     MAX_SECTOR_INDEX sectors each, from FIRST on. */
+  group = (index - MAX_SECTOR_INDEX - 1) / MAX_SECTOR_INDEX;
+  first = MAX_SECTOR_INDEX + 1 + group * MAX_SECTOR_INDEX;
+  if (inode->d_indirect.sector == HOLE_SECTOR)
+    {
+      if (!delayed_in (inode, MAX_SECTOR_INDEX + 1, INT32_MAX))
+        need++;
+    }
+  else
+    block = sector_at_index (inode->d_indirect.sector, group);
+  if (block == HOLE_SECTOR
+      && !delayed_in (inode, first, first + MAX_SECTOR_INDEX - 1))
+    need++;
+  return need;
+}
+
+/* Adds DELTA to the number of delayed sectors of INODE, and to
+   delayed_total.  Must be called with INODE's growth_lock held. */
+static void
+delayed_count (struct inode *inode, int delta)
+{
+  inode->delayed_cnt += delta;
+  lock_acquire (&delayed_total_lock);
+  delayed_total += delta;
+  lock_release (&delayed_total_lock);
+}
+
+/* Adds INODE to delayed_inodes, unless it is there already. */
+static void
+delayed_list_add (struct inode *inode)
+{
+  lock_acquire (&delayed_lock);
+  if (!inode->delayed_listed)
+    {
+      list_push_back (&delayed_inodes, &inode->delayed_elem);
+      inode->delayed_listed = true;
+    }
+  lock_release (&delayed_lock);
+}
+
+/* Allocates disk sectors for the delayed data of INODE and moves
+   it into the cache, from which it is written back.  Each run of
+   consecutive file sectors goes right after the sector before it in
+   the file if there is room there, and else takes as long a run as
+   the free map has, so that the file stays consecutive on disk; a
+   run the free map only has in pieces, being fragmented, takes
+   several.  The sectors, index blocks included, come out of the
+   space reserved for the data, and what the index blocks did not
+   need is given back.  Data writers wait for the dirty ratio before
+   each cache slot they dirty, as in inode_write_at().  Data that
+   finds no room, which takes running out of memory for the index,
+   stays delayed.  Must be called with INODE's growth_lock held. */
+static void
+delayed_commit (struct inode *inode)
+{
+  while (!list_empty (&inode->delayed))
+    {
+      struct delayed_sector *first = list_entry (list_front (&inode->delayed),
+                                                 struct delayed_sector, elem);
+      block_sector_t start = HOLE_SECTOR;
+      size_t cnt = 1, got, mapped, i;
+      struct list_elem *e;
+
+      for (e = list_next (&first->elem);
+           e != list_end (&inode->delayed) && cnt < DELAY_MAX_SECTORS;
+           e = list_next (e), cnt++)
+        if (list_entry (e, struct delayed_sector, elem)->index
+            != first->index + (off_t) cnt)
+          break;
+
+      got = allocate_run (inode, first->index, cnt, &start,
+                          &inode->delayed_reserved);
+      if (got == 0)
         break;
-   }
 
-done:
-  if (sectors_left != -1)
-     block_write (fs_device, d_indirect->sector, buffer);
-  free (buffer);
-  return sectors_left;
+      /* Fill the cache before mapping the sectors, so that readers
+         who find them mapped find the data too. */
+      e = &first->elem;
+      for (i = 0; i < got; i++)
+        {
+          struct delayed_sector *d = list_entry (e, struct delayed_sector,
+                                                 elem);
+          struct cache_entry *entry;
+
+          if (inode->cache_class == CACHE_DATA
+              && (i == 0 || (start + i) % CACHE_BLOCK_SECTORS == 0))
+            cache_throttle ();
+          entry = cache_get (start + i, CACHE_OVERWRITE, inode->cache_class);
+          memcpy (cache_data (entry, start + i), d->data, BLOCK_SECTOR_SIZE);
+          cache_set_owner (entry, inode->sector);
+          cache_put (entry, CACHE_OVERWRITE);
+          e = list_next (e);
+        }
+
+      mapped = map_run (inode, first->index, start, got,
+                        &inode->delayed_reserved);
+      for (i = 0; i < mapped; i++)
+        free (list_entry (list_pop_front (&inode->delayed),
+                          struct delayed_sector, elem));
+      delayed_count (inode, -(int) mapped);
+      if (mapped < got)
+        {
+          /* Out of memory: the rest stays delayed, and its sectors,
+             freed again, go back to the reservation. */
+          if (free_map_reserve (got - mapped))
+            inode->delayed_reserved += got - mapped;
+          break;
+        }
+    }
+
+  /* Index blocks found allocated already leave some of the
+     reservation unused. */
+  if (list_empty (&inode->delayed))
+    {
+      free_map_unreserve (inode->delayed_reserved);
+      inode->delayed_reserved = 0;
+    }
+}
+
+/* Drops the delayed data of INODE and the space reserved for it.
+   Must be called with INODE's growth_lock held. */
+static void
+delayed_discard (struct inode *inode)
+{
+  while (!list_empty (&inode->delayed))
+    free (list_entry (list_pop_front (&inode->delayed),
+                      struct delayed_sector, elem));
+  free_map_unreserve (inode->delayed_reserved);
+  delayed_count (inode, -(int) inode->delayed_cnt);
+  inode->delayed_reserved = 0;
+}
+
+/* Writes SIZE bytes from BUFFER at OFFSET of INODE, within one
+   sector that is a hole, into the delayed data of INODE, reserving
+   the space for its sector and the index blocks mapping it, which
+   are only allocated when the data is written back.  The delayed
+   data of INODE is committed once it reaches DELAY_MAX_SECTORS, or
+   that of all inodes DELAY_TOTAL_MAX.  Returns false if the disk is
+   full. */
+static bool
+delayed_write (struct inode *inode, const void *buffer, int size,
+               off_t offset)
+{
+  off_t index = offset / BLOCK_SECTOR_SIZE;
+  struct delayed_sector *d = NULL;
+  struct list_elem *e;
+  block_sector_t sector;
+  bool added = false;
+
+  lock_acquire (&inode->growth_lock);
+
+  /* The hole may have been filled since the caller looked. */
+  sector = byte_to_sector (inode, offset);
+  if (sector != HOLE_SECTOR)
+    {
+      struct cache_entry *entry = cache_get (sector, CACHE_WRITE,
+                                             inode->cache_class);
+      memcpy ((uint8_t *) cache_data (entry, sector)
+              + offset % BLOCK_SECTOR_SIZE, buffer, size);
+      cache_set_owner (entry, inode->sector);
+      cache_put (entry, CACHE_WRITE);
+      lock_release (&inode->growth_lock);
+      return true;
+    }
+
+  d = delayed_find (inode, index);
+  if (d == NULL)
+    {
+      size_t need = delayed_need (inode, index);
+
+      d = malloc (sizeof *d);
+      if (d == NULL || !free_map_reserve (need))
+        {
+          lock_release (&inode->growth_lock);
+          free (d);
+          return false;
+        }
+      inode->delayed_reserved += need;
+      d->index = index;
+      memset (d->data, 0, BLOCK_SECTOR_SIZE);
+      for (e = list_begin (&inode->delayed); e != list_end (&inode->delayed);
+           e = list_next (e))
+        if (list_entry (e, struct delayed_sector, elem)->index > index)
+          break;
+      list_insert (e, &d->elem);
+      delayed_count (inode, 1);
+      added = true;
+    }
+  memcpy (d->data + offset % BLOCK_SECTOR_SIZE, buffer, size);
+
+  if (inode->delayed_cnt >= DELAY_MAX_SECTORS
+      || delayed_total >= DELAY_TOTAL_MAX)
+    delayed_commit (inode);
+  lock_release (&inode->growth_lock);
+
+  if (added)
+    delayed_list_add (inode);
+  return true;
+}
+
+/* Reads SIZE bytes at OFFSET of INODE, within one sector that is a
+   hole, into BUFFER: the delayed data written there, or zeros.
+   Returns HOLE_SECTOR, or the sector allocated there since the
+   caller looked, which the caller must read instead. */
+static block_sector_t
+hole_read (struct inode *inode, void *buffer, int size, off_t offset)
+{
+  struct delayed_sector *d;
+  block_sector_t sector;
+
+  lock_acquire (&inode->growth_lock);
+  sector = byte_to_sector (inode, offset);
+  if (sector == HOLE_SECTOR)
+    {
+      d = delayed_find (inode, offset / BLOCK_SECTOR_SIZE);
+      if (d != NULL)
+        memcpy (buffer, d->data + offset % BLOCK_SECTOR_SIZE, size);
+      else
+        memset (buffer, 0, size);
+    }
+  lock_release (&inode->growth_lock);
+  return sector;
+}
+
+/* Allocates sectors for the delayed data of every open inode and
+   moves it into the cache, to be written back from there.  Called
+   by the write-behind daemon before it flushes, and at shutdown.
+   Unless BLOCK is true, inodes whose locks are busy are left for
+   the next call instead of waited for: the write-behind daemon
+   must not wait for writers that may be throttled, waiting for it
+   with those locks held. */
+void
+inode_flush_delayed (bool block)
+{
+  struct list retry;
+
+  list_init (&retry);
+  if (block)
+    lock_acquire (&delayed_lock);
+  else if (!lock_try_acquire (&delayed_lock))
+    return;
+  while (!list_empty (&delayed_inodes))
+    {
+      struct inode *inode = list_entry (list_pop_front (&delayed_inodes),
+                                        struct inode, delayed_elem);
+
+      if (block)
+        lock_acquire (&inode->growth_lock);
+      else if (!lock_try_acquire (&inode->growth_lock))
+        {
+          list_push_back (&retry, &inode->delayed_elem);
+          continue;
+        }
+      delayed_commit (inode);
+      if (inode->delayed_cnt > 0)
+        list_push_back (&retry, &inode->delayed_elem);
+      else
+        inode->delayed_listed = false;
+      lock_release (&inode->growth_lock);
+    }
+  while (!list_empty (&retry))
+    list_push_back (&delayed_inodes, list_pop_front (&retry));
+  lock_release (&delayed_lock);
 }
 
 /* Reads an inode from SECTOR
@@ -280,20 +955,18 @@ struct inode *
 inode_open (block_sector_t sector)
 {
   struct inode_disk disk_inode; 
-  struct list_elem *e;
+  struct hash_elem *e;
   struct inode *inode;
 
-  /* Check whether this inode is already open. */
-  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
-       e = list_next (e)) 
-    {
-      inode = list_entry (e, struct inode, elem);
-      if (inode->sector == sector) 
-        {
-          inode_reopen (inode);
-          return inode; 
-        }
-    }
+  /* Check whether this inode is already open, or was closed
+     recently. */
+  lock_acquire (&open_inodes_lock);
+  inode = open_inode_find (sector);
+  if (inode != NULL)
+    open_inode_get (inode);
+  lock_release (&open_inodes_lock);
+  if (inode != NULL)
+    return inode;
 
   /* Allocate memory. */
   inode = malloc (sizeof *inode);
@@ -301,28 +974,110 @@ inode_open (block_sector_t sector)
     return NULL;
 
   /* Initialize. */
-  list_push_front (&open_inodes, &inode->elem);
   inode->sector = sector;
   inode->open_cnt = 1;
   inode->deny_write_cnt = 0;
   inode->removed = false;
 
-  block_read (fs_device, sector, &disk_inode);
+  meta_read (sector, &disk_inode);
   inode->direct = disk_inode.direct;
   inode->indirect = disk_inode.indirect;
   inode->d_indirect = disk_inode.d_indirect;
   inode->length = disk_inode.length;
   inode->is_directory = disk_inode.is_directory;
+  inode->is_inline = disk_inode.is_inline;
+  inode->extents = NULL;
+  if (disk_inode.magic == INODE_EXTENT_MAGIC)
+    {
+      inode->extents = malloc (sizeof *inode->extents);
+      if (inode->extents == NULL)
+        {
+          free (inode);
+          return NULL;
+        }
+      if (inode->is_inline)
+        memset (inode->extents, 0, sizeof *inode->extents);
+      else
+        *inode->extents = disk_inode.extents;
+    }
+  inode->cache_class = CACHE_DATA;
   lock_init (&inode->growth_lock);
+  lock_init (&inode->memo_lock);
+  inode->memo_sector = NO_SECTOR;
+  inode->memo = NULL;
+  inode->memo_dindex = -1;
+  inode->memo_extent.length = 0;
+  list_init (&inode->delayed);
+  inode->delayed_cnt = 0;
+  inode->delayed_reserved = 0;
+  inode->delayed_listed = false;
+
+  /* Use the inode opened by someone else meanwhile, if any. */
+  lock_acquire (&open_inodes_lock);
+  e = hash_insert (&open_inodes, &inode->elem);
+  if (e != NULL)
+    {
+      free (inode->extents);
+      free (inode);
+      inode = hash_entry (e, struct inode, elem);
+      open_inode_get (inode);
+    }
+  lock_release (&open_inodes_lock);
   return inode;
 }
 
+/* Returns the inode for SECTOR in open_inodes, or a null pointer if
+   it is not there.  Must be called with open_inodes_lock held. */
+static struct inode *
+open_inode_find (block_sector_t sector)
+{
+  struct inode key;
+  struct hash_elem *e;
+
+  key.sector = sector;
+  e = hash_find (&open_inodes, &key.elem);
+  return e != NULL ? hash_entry (e, struct inode, elem) : NULL;
+}
+
+/* Adds an opener to INODE, found in open_inodes, taking it off
+   closed_inodes if it had none.  Must be called with
+   open_inodes_lock held. */
+static void
+open_inode_get (struct inode *inode)
+{
+  if (inode->open_cnt++ == 0)
+    {
+      list_remove (&inode->closed_elem);
+      closed_cnt--;
+    }
+}
+
+/* Returns a hash value for the inode at E, from its sector. */
+static unsigned
+inode_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  return hash_int ((int) hash_entry (e, struct inode, elem)->sector);
+}
+
+/* Returns true if the inode at A precedes the inode at B. */
+static bool
+inode_less (const struct hash_elem *a, const struct hash_elem *b,
+            void *aux UNUSED)
+{
+  return hash_entry (a, struct inode, elem)->sector
+         < hash_entry (b, struct inode, elem)->sector;
+}
+
 /* Reopens and returns INODE. */
 struct inode *
 inode_reopen (struct inode *inode)
 {
   if (inode != NULL)
-    inode->open_cnt++;
+    {
+      lock_acquire (&open_inodes_lock);
+      inode->open_cnt++;
+      lock_release (&open_inodes_lock);
+    }
   return inode;
 }
 
@@ -340,80 +1095,165 @@ inode_is_directory (struct inode *inode)
   return inode->is_directory;
 }
 
+/* Caches the data of INODE as CLASS.  Directories and the free
+   map mark their inodes CACHE_META; data is the default. */
+void
+inode_set_cache_class (struct inode *inode, enum cache_class class)
+{
+  inode->cache_class = class;
+}
+
+/* Writes the dirty cached data of INODE to disk, returning once
+   it is there, after allocating sectors for its delayed data.  With
+   METADATA, the free map, which records the sectors allocated to
+   INODE, is written back too. */
+void
+inode_sync (struct inode *inode, bool metadata)
+{
+  lock_acquire (&inode->growth_lock);
+  delayed_commit (inode);
+  lock_release (&inode->growth_lock);
+  cache_flush_owner (inode->sector);
+  if (metadata)
+    cache_flush_owner (FREE_MAP_SECTOR);
+}
+
 /* Closes INODE and writes it to disk.
-   If this was the last reference to INODE, frees its memory.
-   If INODE was also a removed inode, frees its blocks. */
+   If this was the last reference to INODE, keeps it among the
+   recently closed inodes, from which the oldest one is freed.
+   If INODE was also a removed inode, frees it and its blocks. */
 void
 inode_close (struct inode *inode) 
 {
+  struct inode *victim = NULL;
+  bool last;
+
   /* Ignore null pointer. */
   if (inode == NULL)
     return;
 
-  /* Release resources if this was the last opener. */
-  if (--inode->open_cnt == 0)
+  /* The last opener gives delayed data its sectors while the inode
+     can still be found, so that anyone opening it meanwhile shares
+     this copy instead of reading the inode before it is updated. */
+  lock_acquire (&open_inodes_lock);
+  last = inode->open_cnt == 1;
+  lock_release (&open_inodes_lock);
+  if (last && !inode->removed)
+    {
+      lock_acquire (&inode->growth_lock);
+      delayed_commit (inode);
+      lock_release (&inode->growth_lock);
+    }
+
+  lock_acquire (&open_inodes_lock);
+  last = --inode->open_cnt == 0;
+  if (last && inode->removed)
     {
-      /* Remove from inode list and release lock. */
-      list_remove (&inode->elem);
- 
-      /* Deallocate blocks if removed. */
-      if (inode->removed) 
+      hash_delete (&open_inodes, &inode->elem);
+      victim = inode;
+    }
+  else if (last)
+    {
+      list_push_front (&closed_inodes, &inode->closed_elem);
+      if (++closed_cnt > CLOSED_INODES_MAX)
         {
-          inode_deallocate (inode);
+          victim = list_entry (list_pop_back (&closed_inodes),
+                               struct inode, closed_elem);
+          closed_cnt--;
+          hash_delete (&open_inodes, &victim->elem);
         }
+    }
+  lock_release (&open_inodes_lock);
 
-      free (inode); 
+  if (victim != NULL)
+    inode_free (victim);
+}
+
+/* Frees INODE, which nobody has open and which can no longer be
+   found in open_inodes, along with its blocks if it was removed. */
+static void
+inode_free (struct inode *inode)
+{
+  lock_acquire (&delayed_lock);
+  if (inode->delayed_listed)
+    list_remove (&inode->delayed_elem);
+  lock_release (&delayed_lock);
+
+  /* Data delayed since the last close gets its sectors too, unless
+     the inode is removed.  Its space is reserved, so only running
+     out of memory can lose it. */
+  lock_acquire (&inode->growth_lock);
+  if (!inode->removed)
+    delayed_commit (inode);
+  delayed_discard (inode);
+  lock_release (&inode->growth_lock);
+
+  /* Deallocate blocks if removed. */
+  if (inode->removed) 
+    {
+      inode_deallocate (inode);
     }
+
+  free (inode->memo);
+  free (inode->extents);
+  free (inode); 
 }
 
+/* Frees the inode sector of INODE and every sector holding its
+   data or its indirect blocks, skipping holes.  Cached copies of
+   them are dropped rather than written back. */
 void
 inode_deallocate (struct inode *inode)
 {
-   block_sector_t sector, dsector;
-   struct cache_entry *entry = NULL, *dentry = NULL;
-   block_sector_t *dbuffer, *ibuffer;
-   int i,j,k;
-
-   /* Deallocate sector where inode is stored */
-   free_map_release (inode->sector, 1);
-
-   /* Deallocate direct pointer */
-   free_map_release (inode->direct, 1);
-
-   /* Deallocate indirect pointer */
-   entry = cache_read (inode->indirect.sector, BLOCK_SECTOR_SIZE);
-   ibuffer = (block_sector_t *)entry->data;
-   for (i = 0; i < inode->indirect.offset; i++)
-    {
-     memcpy (&sector, ibuffer, sizeof (block_sector_t));
-     free_map_release (sector, 1);
-     ibuffer++; 
-    }
-    free_map_release (inode->indirect.sector, 1);
-
-    /* Deallocate double indirect pointer */
-    entry = cache_read (inode->d_indirect.sector, BLOCK_SECTOR_SIZE);
-    ibuffer = (block_sector_t *)entry->data;
-    for (j = 0; j < inode->d_indirect.off1; j++)
-     {
-      memcpy (&sector, ibuffer, sizeof (block_sector_t));
-      dentry = cache_read (sector, BLOCK_SECTOR_SIZE);
-      dbuffer = (block_sector_t *)dentry->data;
-      for (k = 0; k < inode->d_indirect.off2; k++)
-       {
-         memcpy (&dsector, dbuffer, sizeof (block_sector_t));
-         free_map_release (dsector, 1);
-         dbuffer++;
-       }
-       free_map_release (sector, 1);
-       ibuffer++;
-     }
-    free_map_release (inode->d_indirect.sector, 1);   
-
-  if (entry)
-    entry->sector = EMPTY;
-  if (dentry)
-    dentry->sector = EMPTY;
+  block_sector_t *ibuffer = NULL, *dbuffer = NULL;
+  size_t i;
+
+  if (inode->is_inline)
+    goto done;
+  if (inode->extents != NULL)
+    {
+      extent_free (inode->extents);
+      goto done;
+    }
+
+  /* Deallocate direct pointer */
+  if (inode->direct != HOLE_SECTOR)
+    release_sectors (&inode->direct, 1);
+
+  ibuffer = malloc (BLOCK_SECTOR_SIZE);
+  if (ibuffer == NULL)
+    goto done;
+
+  /* Deallocate indirect pointer */
+  if (inode->indirect.sector != HOLE_SECTOR)
+   {
+     meta_read (inode->indirect.sector, ibuffer);
+     release_index (ibuffer);
+     release_sectors (&inode->indirect.sector, 1);
+   }
+
+  /* Deallocate double indirect pointer */
+  if (inode->d_indirect.sector != HOLE_SECTOR)
+   {
+     dbuffer = malloc (BLOCK_SECTOR_SIZE);
+     if (dbuffer == NULL)
+       goto done;
+     meta_read (inode->d_indirect.sector, dbuffer);
+     for (i = 0; i < MAX_SECTOR_INDEX; i++)
+       if (dbuffer[i] != HOLE_SECTOR)
+        {
+          meta_read (dbuffer[i], ibuffer);
+          release_index (ibuffer);
+        }
+     release_index (dbuffer);
+     release_sectors (&inode->d_indirect.sector, 1);
+   }
+
+done:
+  /* Deallocate sector where inode is stored */
+  release_sectors (&inode->sector, 1);
+  free (ibuffer);
+  free (dbuffer);
 }
 
 /* Marks INODE to be deleted when it is closed by the last caller who
@@ -425,6 +1265,98 @@ inode_remove (struct inode *inode)
   inode->removed = true;
 }
 
+/* Reads up to SIZE bytes at OFFSET from INODE, whose data is
+   inline, into BUFFER, and returns the number of bytes read.  Must
+   be called with INODE's growth_lock held. */
+static off_t
+inline_read (struct inode *inode, void *buffer, off_t size, off_t offset)
+{
+  struct cache_entry *entry;
+  struct inode_disk *disk_inode;
+
+  if (offset >= inode->length || size <= 0)
+    return 0;
+  if (size > inode->length - offset)
+    size = inode->length - offset;
+
+  entry = cache_get (inode->sector, CACHE_READ, CACHE_META);
+  disk_inode = cache_data (entry, inode->sector);
+  memcpy (buffer, disk_inode->data + offset, size);
+  cache_put (entry, CACHE_READ);
+  return size;
+}
+
+/* Writes SIZE bytes from BUFFER at OFFSET into INODE, whose data is
+   inline and has room for them, extending the file if needed.
+   Returns the number of bytes written.  Must be called with
+   INODE's growth_lock held. */
+static off_t
+inline_write (struct inode *inode, const void *buffer, off_t size,
+              off_t offset)
+{
+  struct cache_entry *entry;
+  struct inode_disk *disk_inode;
+
+  ASSERT (offset + size <= INODE_INLINE_MAX);
+
+  entry = cache_get (inode->sector, CACHE_WRITE, CACHE_META);
+  disk_inode = cache_data (entry, inode->sector);
+  memcpy (disk_inode->data + offset, buffer, size);
+  if (offset + size > disk_inode->length)
+    disk_inode->length = offset + size;
+  inode->length = disk_inode->length;
+  cache_set_owner (entry, inode->sector);
+  cache_put (entry, CACHE_WRITE);
+  return size;
+}
+
+/* Moves the data of INODE out of its inode sector into a data
+   sector, so that the file can grow past INODE_INLINE_MAX bytes.
+   Readers keep reading the inline copy until the data sector holds
+   it.  Returns false if the disk is full.  Must be called with
+   INODE's growth_lock held. */
+static bool
+inline_spill (struct inode *inode)
+{
+  struct inode_disk *disk_inode = malloc (sizeof *disk_inode);
+  struct inode_disk *saved = malloc (sizeof *saved);
+  off_t length = inode->length;
+  bool success = false;
+
+  if (disk_inode == NULL || saved == NULL)
+    goto done;
+
+  meta_read (inode->sector, saved);
+  *disk_inode = *saved;
+  disk_inode->is_inline = false;
+  memset (disk_inode->data, 0, sizeof disk_inode->data);
+  meta_write (inode->sector, disk_inode, inode->sector);
+
+  /* Inline data maps no sectors, so its first sector is a hole. */
+  if (length > 0)
+    {
+      block_sector_t sector = inode_allocate_sector (inode, 0);
+      struct cache_entry *entry;
+
+      if (sector == HOLE_SECTOR)
+        {
+          meta_write (inode->sector, saved, inode->sector);
+          goto done;
+        }
+      entry = cache_get (sector, CACHE_WRITE, inode->cache_class);
+      memcpy (cache_data (entry, sector), saved->data, length);
+      cache_set_owner (entry, inode->sector);
+      cache_put (entry, CACHE_WRITE);
+    }
+  inode->is_inline = false;
+  success = true;
+
+done:
+  free (disk_inode);
+  free (saved);
+  return success;
+}
+
 /* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
    Returns the number of bytes actually read, which may be less
    than SIZE if an error occurs or end of file is reached. */
@@ -434,8 +1366,20 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
   uint8_t *buffer = buffer_;
   off_t bytes_read = 0;
   struct cache_entry *entry = NULL;
-  struct read_ahead_struct *r = malloc (sizeof (struct read_ahead_struct));
-   
+
+  if (inode->is_inline)
+    {
+      bool done;
+
+      lock_acquire (&inode->growth_lock);
+      done = inode->is_inline;
+      if (done)
+        bytes_read = inline_read (inode, buffer, size, offset);
+      lock_release (&inode->growth_lock);
+      if (done)
+        return bytes_read;
+    }
+
   while (size > 0) 
     {
       /* Disk sector to read, starting byte offset within sector. */
@@ -444,21 +1388,40 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
         return bytes_read;
       int sector_ofs = offset % BLOCK_SECTOR_SIZE;
 
-      /* Bytes left in inode, bytes left in sector, lesser of the two. */
+      /* Bytes left in inode, bytes wanted from it. */
       off_t inode_left = inode_length (inode) - offset;
-      int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
+      off_t want = size < inode_left ? size : inode_left;
+      if (want <= 0)
+        break;
+
+      /* Sectors read at once, bytes left in them, lesser of that and
+         bytes left in inode.  A hole is read a sector at a time. */
+      int sector_cnt = 1;
+      if (sector_idx != HOLE_SECTOR)
+        sector_cnt = sector_run (inode, offset - sector_ofs, sector_idx,
+                                 DIV_ROUND_UP (sector_ofs + want,
+                                               BLOCK_SECTOR_SIZE));
+      int sector_left = sector_cnt * BLOCK_SECTOR_SIZE - sector_ofs;
       int min_left = inode_left < sector_left ? inode_left : sector_left;
 
-      /* Number of bytes to actually copy out of this sector. */
+      /* Number of bytes to actually copy out of these sectors. */
       int chunk_size = size < min_left ? size : min_left;
       if (chunk_size <= 0)
         break;
 
-      entry = cache_read (sector_idx, BLOCK_SECTOR_SIZE);
-      memcpy (buffer + bytes_read, entry->data + sector_ofs, chunk_size);
-      r->inode = inode;
-      r->offset = offset + BLOCK_SECTOR_SIZE;
-      
+      if (sector_idx == HOLE_SECTOR)
+        sector_idx = hole_read (inode, buffer + bytes_read, chunk_size,
+                                offset);
+      if (sector_idx != HOLE_SECTOR)
+        {
+          entry = cache_get_range (sector_idx, sector_cnt, CACHE_READ,
+                                   inode->cache_class);
+          memcpy (buffer + bytes_read,
+                  (uint8_t *) cache_data (entry, sector_idx) + sector_ofs,
+                  chunk_size);
+          cache_put (entry, CACHE_READ);
+        }
+
       /* Advance. */
       size -= chunk_size;
       offset += chunk_size;
@@ -470,9 +1433,9 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
 
 /* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
    Returns the number of bytes actually written, which may be
-   less than SIZE if end of file is reached or an error occurs.
-   (Normally a write at end of file would extend the inode, but
-   growth is not yet implemented.) */
+   less than SIZE if the disk is full or an error occurs.  Writing
+   past end of file extends the inode, leaving a hole between the
+   old end and OFFSET; sectors are allocated as they are written. */
 off_t
 inode_write_at (struct inode *inode, const void *buffer_, off_t size,
                 off_t offset) 
@@ -484,6 +1447,27 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
   if (inode->deny_write_cnt)
     return 0;
 
+  /* Write inline data in place while it fits, else move it out. */
+  if (inode->is_inline)
+    {
+      bool done = false;
+
+      lock_acquire (&inode->growth_lock);
+      if (inode->is_inline)
+        {
+          if (offset + size <= INODE_INLINE_MAX)
+            {
+              bytes_written = inline_write (inode, buffer, size, offset);
+              done = true;
+            }
+          else
+            done = !inline_spill (inode);
+        }
+      lock_release (&inode->growth_lock);
+      if (done)
+        return bytes_written;
+    }
+
   /* If offset is greater than current length of the file
      grow the file */
   if ((size + offset) > inode->length)
@@ -503,19 +1487,63 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
       block_sector_t sector_idx = byte_to_sector (inode, offset);
       int sector_ofs = offset % BLOCK_SECTOR_SIZE;
 
-      /* Bytes left in inode, bytes left in sector, lesser of the two. */
+      /* Bytes left in inode, bytes wanted from it. */
       off_t inode_left = inode_length (inode) - offset;
-      int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
+      off_t want = size < inode_left ? size : inode_left;
+
+      /* Data written to a hole is delayed: its sector is allocated
+         when it is written back. */
+      if (sector_idx == HOLE_SECTOR)
+        {
+          int hole_size = BLOCK_SECTOR_SIZE - sector_ofs;
+          if (hole_size > want)
+            hole_size = want;
+          if (hole_size <= 0
+              || !delayed_write (inode, buffer + bytes_written, hole_size,
+                                 offset))
+            break;
+          size -= hole_size;
+          offset += hole_size;
+          bytes_written += hole_size;
+          continue;
+        }
+
+      /* Whole sectors are written a run at a time.  Bytes left in the
+         sectors written at once, lesser of that and bytes left in
+         inode. */
+      int sector_cnt = 1;
+      if (sector_ofs == 0 && want >= BLOCK_SECTOR_SIZE)
+        sector_cnt = sector_run (inode, offset, sector_idx,
+                                 want / BLOCK_SECTOR_SIZE);
+      int sector_left = sector_cnt * BLOCK_SECTOR_SIZE - sector_ofs;
       int min_left = inode_left < sector_left ? inode_left : sector_left;
 
-      /* Number of bytes to actually write into this sector. */
+      /* Number of bytes to actually write into these sectors. */
       int chunk_size = size < min_left ? size : min_left;
       if (chunk_size <= 0)
         break;
 
-      entry = cache_read (sector_idx, BLOCK_SECTOR_SIZE);
-      memcpy (entry->data + sector_ofs, buffer + bytes_written, chunk_size);
-      cache_write (sector_idx, entry->data, chunk_size);
+      /* A chunk that covers whole sectors replaces their contents:
+         no need to read them.  One that stops short at end of file
+         does not, as a writer extending the file may have written
+         past that end since it was read. */
+      enum cache_mode mode = CACHE_WRITE;
+      if (sector_ofs == 0 && chunk_size == sector_left)
+        mode = CACHE_OVERWRITE;
+
+      /* Only data writers are throttled.  Metadata, the free map
+         included, is written with inode locks held, some of them
+         by the write-behind daemon as it allocates sectors, so a
+         metadata writer waiting for the daemon could wait
+         forever. */
+      if (inode->cache_class == CACHE_DATA)
+        cache_throttle ();
+      entry = cache_get_range (sector_idx, sector_cnt, mode,
+                               inode->cache_class);
+      uint8_t *data = cache_data (entry, sector_idx);
+      memcpy (data + sector_ofs, buffer + bytes_written, chunk_size);
+      cache_set_owner (entry, inode->sector);
+      cache_put (entry, mode);
 
       /* Advance. */
       size -= chunk_size;
@@ -526,6 +1554,193 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
   return bytes_written;
 }
 
+/* Writes up to CNT whole sectors from BUFFER to the hole of INODE
+   at byte offset POS, which is sector aligned.  As many sectors of
+   the hole as fit in one run are allocated at once and written
+   straight to the device; they are only mapped afterwards, so
+   readers see zeros until they hold the data.  Returns the number
+   of sectors written, 0 if the disk is full or if the sector at POS
+   is no longer a hole. */
+static size_t
+hole_write_direct (struct inode *inode, const uint8_t *buffer, off_t pos,
+                   size_t cnt)
+{
+  off_t index = pos / BLOCK_SECTOR_SIZE;
+  block_sector_t start;
+  size_t n = 1, got = 0;
+
+  lock_acquire (&inode->growth_lock);
+
+  /* Delayed data written since the caller committed it would be
+     mapped over these sectors later. */
+  delayed_commit (inode);
+  if (byte_to_sector (inode, pos) != HOLE_SECTOR)
+    goto done;
+  while (n < cnt
+         && byte_to_sector (inode, pos + n * BLOCK_SECTOR_SIZE)
+            == HOLE_SECTOR)
+    n++;
+
+  got = allocate_run (inode, index, n, &start, NULL);
+  if (got > 0)
+    {
+      block_write_multiple (fs_device, start, buffer, got);
+
+      /* Drop the old contents of the sectors, which read-ahead or
+         cache warm-up may have brought in. */
+      cache_discard (start, got);
+      got = map_run (inode, index, start, got, NULL);
+    }
+
+done:
+  lock_release (&inode->growth_lock);
+  return got;
+}
+
+/* Transfers the whole sectors of INODE between byte offsets START
+   and END, which are sector aligned and within the file, and
+   BUFFER, writing them if WRITE is true and reading them otherwise.
+   Runs of sectors consecutive on disk go straight between the
+   device and BUFFER, bypassing the cache, unless the cache has to
+   take part to stay coherent (see cache_bypass()).  Holes read as
+   zeros, and are written a run at a time by hole_write_direct().
+   Returns the offset reached, short of END only if the disk is
+   full. */
+static off_t
+inode_transfer_direct (struct inode *inode, uint8_t *buffer, off_t start,
+                       off_t end, bool write)
+{
+  while (start < end)
+    {
+      block_sector_t sector = byte_to_sector (inode, start);
+      int max = (end - start) / BLOCK_SECTOR_SIZE;
+      if (max > DIRECT_RUN_MAX)
+        max = DIRECT_RUN_MAX;
+      if (sector == HOLE_SECTOR && !write)
+        {
+          memset (buffer, 0, BLOCK_SECTOR_SIZE);
+          buffer += BLOCK_SECTOR_SIZE;
+          start += BLOCK_SECTOR_SIZE;
+          continue;
+        }
+      if (sector == HOLE_SECTOR)
+        {
+          off_t bytes = hole_write_direct (inode, buffer, start, max)
+                        * BLOCK_SECTOR_SIZE;
+          if (bytes == 0
+              && byte_to_sector (inode, start) == HOLE_SECTOR)
+            break;
+          buffer += bytes;
+          start += bytes;
+          continue;
+        }
+
+      int cnt = device_run (inode, start, sector, max);
+      off_t bytes = cnt * BLOCK_SECTOR_SIZE;
+
+      if (!cache_bypass (sector, cnt, write ? CACHE_OVERWRITE : CACHE_READ))
+        {
+          if (write)
+            inode_write_at (inode, buffer, bytes, start);
+          else
+            inode_read_at (inode, buffer, bytes, start);
+        }
+      else if (write)
+        {
+          block_write_multiple (fs_device, sector, buffer, cnt);
+
+          /* Drop any copy read into the cache meanwhile. */
+          cache_discard (sector, cnt);
+        }
+      else
+        block_read_multiple (fs_device, sector, buffer, cnt);
+
+      buffer += bytes;
+      start += bytes;
+    }
+  return start;
+}
+
+/* Reads SIZE bytes from INODE into BUFFER, starting at position
+   OFFSET, like inode_read_at(), but transfers the whole sectors
+   of the range straight from the device into BUFFER.  Only the
+   partial sectors at either end go through the cache. */
+off_t
+inode_read_direct (struct inode *inode, void *buffer_, off_t size,
+                   off_t offset)
+{
+  uint8_t *buffer = buffer_;
+  off_t length = inode_length (inode);
+  off_t start, end;
+
+  if (inode->is_inline)
+    return inode_read_at (inode, buffer, size, offset);
+  if (size <= 0 || offset >= length)
+    return 0;
+
+  /* Delayed data has to reach the cache, where the device
+     transfers stay coherent with it. */
+  lock_acquire (&inode->growth_lock);
+  delayed_commit (inode);
+  lock_release (&inode->growth_lock);
+  if (size > length - offset)
+    size = length - offset;
+
+  start = ROUND_UP (offset, BLOCK_SECTOR_SIZE);
+  end = ROUND_DOWN (offset + size, BLOCK_SECTOR_SIZE);
+  if (start >= end)
+    return inode_read_at (inode, buffer, size, offset);
+
+  inode_read_at (inode, buffer, start - offset, offset);
+  inode_transfer_direct (inode, buffer + (start - offset), start, end,
+                         false);
+  inode_read_at (inode, buffer + (end - offset), offset + size - end, end);
+  return size;
+}
+
+/* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET,
+   like inode_write_at(), but transfers the whole sectors of the
+   range straight from BUFFER to the device, dropping the copies
+   the cache held of them.  Only the partial sectors at either end
+   go through the cache. */
+off_t
+inode_write_direct (struct inode *inode, const void *buffer_, off_t size,
+                    off_t offset)
+{
+  uint8_t *buffer = (uint8_t *) buffer_;
+  off_t start, end, reached;
+
+  if (inode->deny_write_cnt || size <= 0)
+    return 0;
+  if (inode->is_inline)
+    return inode_write_at (inode, buffer, size, offset);
+
+  start = ROUND_UP (offset, BLOCK_SECTOR_SIZE);
+  end = ROUND_DOWN (offset + size, BLOCK_SECTOR_SIZE);
+  if (start >= end)
+    return inode_write_at (inode, buffer, size, offset);
+
+  /* Grow the file first, so that the whole range is within it, and
+     give delayed data its sectors, so that the device writes
+     replace it. */
+  lock_acquire (&inode->growth_lock);
+  if (!grow_file (inode, offset + size))
+   {
+     lock_release (&inode->growth_lock);
+     return 0;
+   }
+  delayed_commit (inode);
+  lock_release (&inode->growth_lock);
+
+  inode_write_at (inode, buffer, start - offset, offset);
+  reached = inode_transfer_direct (inode, buffer + (start - offset), start,
+                                   end, true);
+  if (reached < end)
+    return reached - offset;
+  inode_write_at (inode, buffer + (end - offset), offset + size - end, end);
+  return size;
+}
+
 /* Disables writes to INODE.
    May be called at most once per inode opener. */
 void
@@ -553,118 +1768,120 @@ inode_length (const struct inode *inode)
   return inode->length;
 }
 
-/* Grows the INODE upto the given OFFSET */
+/* Sets the format of the inodes created from now on.  Set by
+   do_format(), and to the format of the root directory when an
+   existing file system is mounted. */
+void
+inode_set_format (enum inode_format format)
+{
+  inode_format = format;
+}
+
+/* Returns the format of INODE. */
+enum inode_format
+inode_get_format (const struct inode *inode)
+{
+  return inode->extents != NULL ? INODE_EXTENTS : INODE_INDEXED;
+}
+
+/* Grows the INODE upto the given OFFSET.  The new bytes are a
+   hole: no sectors are allocated until they are written. */
 bool
 grow_file (struct inode *inode, off_t offset) 
 {
+  struct inode_disk *disk_inode;
+
   /* Check if the file is already grown */
-  if (inode->length > offset)
+  if (inode->length >= offset)
    return true;  
-  
-  bool success = true;
-  int bytes_left = (bytes_to_sectors(inode->length) * BLOCK_SECTOR_SIZE)
-			- inode->length;
-  int new_sectors = bytes_to_sectors (offset - inode->length - bytes_left);
-  struct inode_disk *disk_inode = calloc (1, sizeof (struct inode_disk));
-
-  block_read (fs_device, inode->sector, disk_inode);
-  if (new_sectors == 0)
-    goto done;
-  switch (disk_inode->pointer) 
-   {
-     case NONE:
-         if (!free_map_allocate (1, &disk_inode->direct))
-	  {
-	    success = false;	
-	    goto done;
-          }
-          block_write (fs_device, disk_inode->direct, zeros);
-          new_sectors--;
-          disk_inode->pointer = DIRECT;
-          if (new_sectors == 0)
-            {
-	     goto done;
-            }
-      case DIRECT:
-           if (!free_map_allocate (1, &disk_inode->indirect.sector))
-            {
-	      success = false;
-	      goto done;   
-	    }
-            new_sectors = inode_allocate_indirect (&disk_inode->indirect, new_sectors);
-            if (new_sectors == -1)
-             {
-	 	 success = false;
-	  	 goto done;
-	     }
-      	     else if (new_sectors >= 0 && new_sectors < MAX_SECTOR_INDEX)
-	      {
-          	disk_inode->pointer = INDIRECT;
-		if (new_sectors == 0)
-                  goto done;
-              }
-       case INDIRECT:
-          if (disk_inode->indirect.offset < MAX_SECTOR_INDEX)
-	   {
-	     new_sectors = inode_allocate_indirect (&disk_inode->indirect, new_sectors);
-            if (new_sectors == -1)
-             {
-	 	 success = false;
-	  	 goto done;
-	     }
-	   }
-	  if (new_sectors > 0)//(disk_inode->indirect.offset == MAX_SECTOR_INDEX) 
-	   {
-	     if (!free_map_allocate (1, &disk_inode->d_indirect.sector))
-	      {
-		 success = false;
-		 goto done;
-	      }
-	      disk_inode->pointer = DOUBLE_INDIRECT;
-           }
-      	   if (new_sectors == 0)
-	    {
-              goto done;
-            }
-       case DOUBLE_INDIRECT:
-	   new_sectors = inode_allocate_double_indirect (&disk_inode->d_indirect,
-							 new_sectors);
-            if (new_sectors == -1)
-             {
-	 	 success = false;
-	     }
-	     goto done;
-    } 
-done:
-   if (success)
-    {
-     /* Update disk_inode and write it to disk */
-     disk_inode->length = offset;
-     block_write (fs_device, inode->sector, disk_inode);  
-     /* Update in-memory inode */ 
-     inode->length = disk_inode->length;
-     inode->direct = disk_inode->direct;
-     inode->indirect = disk_inode->indirect;
-     inode->d_indirect = disk_inode->d_indirect;
-    }
-     
-   free (disk_inode);
-   return success;
+
+  disk_inode = malloc (sizeof *disk_inode);
+  if (disk_inode == NULL)
+    return false;
+  meta_read (inode->sector, disk_inode);
+  disk_inode->length = offset;
+  meta_write (inode->sector, disk_inode, inode->sector);
+  inode->length = offset;
+  free (disk_inode);
+  return true;
 }
 
+/* Queues a request to prefetch SECTORS sectors of INODE starting
+   at byte OFFSET.  Never blocks on I/O: the request is dropped if
+   the queue is full or there is nothing to prefetch. */
 void
-inode_read_ahead (void *aux)
+inode_read_ahead (struct inode *inode, off_t offset, int sectors)
 {
-  struct read_ahead_struct *r = (struct read_ahead_struct *)aux;
-  if (r->inode == NULL)
-    return;
- 
-  block_sector_t sector = byte_to_sector (r->inode, r->offset);
-  if (sector == NO_SECTOR)
+  struct read_ahead_struct *r;
+
+  if (sectors <= 0 || offset >= inode_length (inode))
     return;
 
-  cache_read (sector, BLOCK_SECTOR_SIZE);
-  
-  thread_exit ();
+  lock_acquire (&read_ahead_lock);
+  if (read_ahead_cnt < READ_AHEAD_QUEUE_SIZE)
+   {
+     r = &read_ahead_queue[(read_ahead_head + read_ahead_cnt)
+			   % READ_AHEAD_QUEUE_SIZE];
+     r->inode = inode_reopen (inode);
+     r->offset = offset;
+     r->sectors = sectors;
+     read_ahead_cnt++;
+     read_ahead_requests++;
+     read_ahead_sectors += sectors;
+     cond_signal (&read_ahead_ready, &read_ahead_lock);
+   }
+  else
+    read_ahead_dropped++;
+  lock_release (&read_ahead_lock);
+}
+
+/* Prints read-ahead statistics. */
+void
+inode_print_stats (void)
+{
+  printf ("Read-ahead: %llu requests, %llu sectors, %llu dropped\n",
+	  read_ahead_requests, read_ahead_sectors, read_ahead_dropped);
+}
+
+/* Function executed by the read-ahead daemon.  Serves queued
+   requests by loading their sectors into the buffer cache. */
+void
+read_ahead_daemon (void *aux UNUSED)
+{
+  struct read_ahead_struct r;
+  block_sector_t sector;
+  int i, cnt;
+
+  while (true)
+   {
+     lock_acquire (&read_ahead_lock);
+     while (read_ahead_cnt == 0)
+       cond_wait (&read_ahead_ready, &read_ahead_lock);
+     r = read_ahead_queue[read_ahead_head];
+     read_ahead_head = (read_ahead_head + 1) % READ_AHEAD_QUEUE_SIZE;
+     read_ahead_cnt--;
+     lock_release (&read_ahead_lock);
+
+     for (i = 0; i < r.sectors; i += cnt)
+      {
+        off_t offset = r.offset + i * BLOCK_SECTOR_SIZE;
+        off_t inode_left = inode_length (r.inode) - offset;
+        if (inode_left <= 0)
+          break;
+        sector = byte_to_sector (r.inode, offset);
+        if (sector == NO_SECTOR)
+          break;
+        if (sector == HOLE_SECTOR)
+          {
+            cnt = 1;
+            continue;
+          }
+        cnt = DIV_ROUND_UP (inode_left, BLOCK_SECTOR_SIZE);
+        if (cnt > r.sectors - i)
+          cnt = r.sectors - i;
+        cnt = sector_run (r.inode, offset, sector, cnt);
+        cache_prefetch (sector, cnt, r.inode->cache_class);
+      }
+     inode_close (r.inode);
+   }
 }
-	   
@@ -4,6 +4,7 @@
 #include <stdbool.h>
 #include "filesys/off_t.h"
 #include "devices/block.h"
+#include "filesys/cache.h"
 
 /* Enum for different types of pointers in inode_disk */
 enum pointer
@@ -29,6 +30,13 @@ struct d_indirect
    off_t off2;		  /* Offset into sector found at off1 */
  };
 
+/* On-disk inode formats, chosen when formatting. */
+enum inode_format
+ {
+   INODE_INDEXED,	/* Direct, indirect and double-indirect pointers */
+   INODE_EXTENTS	/* Tree of extents of consecutive sectors */
+ };
+
 struct bitmap;
 
 void inode_init (void);
@@ -40,14 +48,22 @@ void inode_close (struct inode *);
 void inode_remove (struct inode *);
 off_t inode_read_at (struct inode *, void *, off_t size, off_t offset);
 off_t inode_write_at (struct inode *, const void *, off_t size, off_t offset);
+off_t inode_read_direct (struct inode *, void *, off_t size, off_t offset);
+off_t inode_write_direct (struct inode *, const void *, off_t size,
+                          off_t offset);
 void inode_deny_write (struct inode *);
 void inode_allow_write (struct inode *);
 off_t inode_length (const struct inode *);
 bool inode_is_directory (struct inode *);
+void inode_set_cache_class (struct inode *, enum cache_class);
+void inode_sync (struct inode *, bool metadata);
+void inode_read_ahead (struct inode *, off_t offset, int sectors);
+void inode_flush_delayed (bool block);
+void inode_print_stats (void);
+void inode_set_format (enum inode_format);
+enum inode_format inode_get_format (const struct inode *);
 
 void inode_deallocate (struct inode *);
-int inode_allocate_indirect (struct indirect *,int);
-int inode_allocate_double_indirect (struct d_indirect *,int);
 
 bool grow_file (struct inode *, off_t); 
 
@@ -0,0 +1,27 @@
+#ifndef __LIB_CACHE_STATS_H
+#define __LIB_CACHE_STATS_H
+
+/* Buffer cache statistics, as reported by the cachestat() system
+   call.  Shared between the kernel and user programs. */
+struct cache_stats
+  {
+    unsigned long long hits;            /* Lookups found in the cache. */
+    unsigned long long misses;          /* Lookups read from disk. */
+    unsigned long long meta_hits;       /* Hits on metadata. */
+    unsigned long long meta_misses;     /* Misses on metadata. */
+    unsigned long long evictions;       /* Slots reused for a new sector. */
+    unsigned long long dirty_evictions; /* ...that needed a write back. */
+    unsigned long long flushes;         /* Write-behind rounds that wrote. */
+    unsigned long long flush_writes;    /* Sectors written by flushes. */
+    unsigned long long flush_ticks;     /* Timer ticks spent flushing. */
+    unsigned long long discards;        /* Dirty sectors dropped unwritten. */
+    unsigned long long read_ahead_loads; /* Sectors read by read-ahead. */
+    unsigned long long read_ahead_hits; /* ...that were used afterwards. */
+    unsigned size;                      /* Slots in the cache. */
+    unsigned dirty;                     /* Slots currently dirty. */
+    unsigned meta;                      /* Slots holding metadata. */
+    int read_ahead_window;              /* Read-ahead window of the file
+                                           queried, in sectors, or -1. */
+  };
+
+#endif /* lib/cache-stats.h */
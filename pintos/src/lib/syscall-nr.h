@@ -28,7 +28,13 @@ enum
     SYS_MKDIR,                  /* Create a directory. */
     SYS_READDIR,                /* Reads a directory entry. */
     SYS_ISDIR,                  /* Tests if a fd represents a directory. */
-    SYS_INUMBER                 /* Returns the inode number for a fd. */
+    SYS_INUMBER,                /* Returns the inode number for a fd. */
+
+    /* Buffer cache. */
+    SYS_CACHESTAT,              /* Reads buffer cache statistics. */
+    SYS_FSYNC,                  /* Writes a file and its metadata to disk. */
+    SYS_FDATASYNC,              /* Writes a file's data to disk. */
+    SYS_DIRECTIO                /* Sets whether a file bypasses the cache. */
   };
 
 #endif /* lib/syscall-nr.h */
@@ -182,3 +182,27 @@ inumber (int fd)
 {
   return syscall1 (SYS_INUMBER, fd);
 }
+
+bool
+cachestat (int fd, struct cache_stats *stats)
+{
+  return syscall2 (SYS_CACHESTAT, fd, stats);
+}
+
+bool
+fsync (int fd)
+{
+  return syscall1 (SYS_FSYNC, fd);
+}
+
+bool
+fdatasync (int fd)
+{
+  return syscall1 (SYS_FDATASYNC, fd);
+}
+
+bool
+directio (int fd, bool enable)
+{
+  return syscall2 (SYS_DIRECTIO, fd, (int) enable);
+}
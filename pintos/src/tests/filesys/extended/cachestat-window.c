@@ -0,0 +1,71 @@
+/* Reads a file a sector at a time and checks, with cachestat(),
+   that its read-ahead window doubles on each sequential read up to
+   its largest size, and closes on a random read.  A directory has
+   no window. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define WINDOW_MAX 32           /* Largest window, in sectors. */
+
+static char buf[16384];
+
+/* Returns the read-ahead window of FD, as reported by cachestat(). */
+static int
+window (int fd)
+{
+  struct cache_stats st;
+
+  if (!cachestat (fd, &st))
+    fail ("cachestat failed");
+  return st.read_ahead_window;
+}
+
+void
+test_main (void)
+{
+  const char *file_name = "testfile";
+  int fd, dir_fd, expected = 0;
+  size_t ofs;
+
+  memset (buf, 'r', sizeof buf);
+  CHECK (create (file_name, sizeof buf), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  CHECK (write (fd, buf, sizeof buf) == sizeof buf, "write \"%s\"", file_name);
+  msg ("close \"%s\"", file_name);
+  close (fd);
+
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  if (window (fd) != 0)
+    fail ("window is %d sectors before reading, not 0", window (fd));
+
+  msg ("read \"%s\" sequentially", file_name);
+  for (ofs = 0; ofs < sizeof buf / 2; ofs += 512)
+    {
+      if (read (fd, buf, 512) != 512)
+        fail ("read 512 bytes at offset %zu failed", ofs);
+      expected = expected == 0 ? 1 : expected * 2;
+      if (expected > WINDOW_MAX)
+        expected = WINDOW_MAX;
+      if (window (fd) != expected)
+        fail ("window is %d sectors after reading offset %zu, not %d",
+              window (fd), ofs, expected);
+    }
+
+  msg ("read \"%s\" at random", file_name);
+  seek (fd, 1000);
+  if (read (fd, buf, 100) != 100)
+    fail ("read 100 bytes at offset 1000 failed");
+  if (window (fd) != 0)
+    fail ("window is %d sectors after a random read, not 0", window (fd));
+  msg ("close \"%s\"", file_name);
+  close (fd);
+
+  CHECK ((dir_fd = open ("/")) > 1, "open \"/\"");
+  if (window (dir_fd) != -1)
+    fail ("directory has a window of %d sectors", window (dir_fd));
+  msg ("close \"/\"");
+  close (dir_fd);
+}
@@ -0,0 +1,19 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(cachestat-window) begin
+(cachestat-window) create "testfile"
+(cachestat-window) open "testfile"
+(cachestat-window) write "testfile"
+(cachestat-window) close "testfile"
+(cachestat-window) open "testfile"
+(cachestat-window) read "testfile" sequentially
+(cachestat-window) read "testfile" at random
+(cachestat-window) close "testfile"
+(cachestat-window) open "/"
+(cachestat-window) close "/"
+(cachestat-window) end
+EOF
+pass;
@@ -0,0 +1,7 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_archive ({"testfile" => ["a" x 1000 . "b" x 6000 . "a" x 3000],
+               "direct" => ["d" x 20000]});
+pass;
@@ -0,0 +1,72 @@
+/* Mixes direct and buffered I/O on the same file through two
+   descriptors, one of them switched to direct I/O with directio(),
+   and checks that each sees what the other wrote.  Then writes a
+   new file with direct I/O alone. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define FILE_SIZE 10000
+#define DIRECT_SIZE 20000
+
+static char buf[DIRECT_SIZE];
+static char expected[DIRECT_SIZE];
+
+void
+test_main (void)
+{
+  const char *file_name = "testfile";
+  const char *direct_name = "direct";
+  int fd, direct_fd, dir_fd;
+
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  CHECK ((direct_fd = open (file_name)) > 1, "open \"%s\" again", file_name);
+  CHECK (directio (direct_fd, true), "directio \"%s\"", file_name);
+
+  /* Buffered writes are seen by direct reads. */
+  memset (expected, 'a', FILE_SIZE);
+  CHECK (write (fd, expected, FILE_SIZE) == FILE_SIZE,
+         "write \"%s\" buffered", file_name);
+  CHECK (read (direct_fd, buf, FILE_SIZE) == FILE_SIZE,
+         "read \"%s\" direct", file_name);
+  compare_bytes (buf, expected, FILE_SIZE, 0, file_name);
+
+  /* Direct writes are seen by buffered reads, even of sectors the
+     cache held. */
+  seek (fd, 0);
+  CHECK (read (fd, buf, FILE_SIZE) == FILE_SIZE,
+         "read \"%s\" buffered", file_name);
+  memset (expected + 1000, 'b', 6000);
+  seek (direct_fd, 1000);
+  CHECK (write (direct_fd, expected + 1000, 6000) == 6000,
+         "write \"%s\" direct", file_name);
+  seek (fd, 0);
+  CHECK (read (fd, buf, FILE_SIZE) == FILE_SIZE,
+         "read \"%s\" buffered", file_name);
+  compare_bytes (buf, expected, FILE_SIZE, 0, file_name);
+  msg ("close \"%s\"", file_name);
+  close (fd);
+  msg ("close \"%s\" again", file_name);
+  close (direct_fd);
+  check_file (file_name, expected, FILE_SIZE);
+
+  /* A new file written with direct I/O alone. */
+  memset (expected, 'd', DIRECT_SIZE);
+  CHECK (create (direct_name, 0), "create \"%s\"", direct_name);
+  CHECK ((direct_fd = open (direct_name)) > 1, "open \"%s\"", direct_name);
+  CHECK (directio (direct_fd, true), "directio \"%s\"", direct_name);
+  CHECK (write (direct_fd, expected, DIRECT_SIZE) == DIRECT_SIZE,
+         "write \"%s\" direct", direct_name);
+  msg ("close \"%s\"", direct_name);
+  close (direct_fd);
+  check_file (direct_name, expected, DIRECT_SIZE);
+
+  CHECK (!directio (direct_fd, true), "directio closed file (must fail)");
+  CHECK ((dir_fd = open ("/")) > 1, "open \"/\"");
+  CHECK (!directio (dir_fd, true), "directio \"/\" (must fail)");
+  msg ("close \"/\"");
+  close (dir_fd);
+}
@@ -0,0 +1,35 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(directio-rw) begin
+(directio-rw) create "testfile"
+(directio-rw) open "testfile"
+(directio-rw) open "testfile" again
+(directio-rw) directio "testfile"
+(directio-rw) write "testfile" buffered
+(directio-rw) read "testfile" direct
+(directio-rw) read "testfile" buffered
+(directio-rw) write "testfile" direct
+(directio-rw) read "testfile" buffered
+(directio-rw) close "testfile"
+(directio-rw) close "testfile" again
+(directio-rw) open "testfile" for verification
+(directio-rw) verified contents of "testfile"
+(directio-rw) close "testfile"
+(directio-rw) create "direct"
+(directio-rw) open "direct"
+(directio-rw) directio "direct"
+(directio-rw) write "direct" direct
+(directio-rw) close "direct"
+(directio-rw) open "direct" for verification
+(directio-rw) verified contents of "direct"
+(directio-rw) close "direct"
+(directio-rw) directio closed file (must fail)
+(directio-rw) open "/"
+(directio-rw) directio "/" (must fail)
+(directio-rw) close "/"
+(directio-rw) end
+EOF
+pass;
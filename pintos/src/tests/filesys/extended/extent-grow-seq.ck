@@ -0,0 +1,17 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+use tests::random;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(extent-grow-seq) begin
+(extent-grow-seq) create "testme"
+(extent-grow-seq) open "testme"
+(extent-grow-seq) writing "testme"
+(extent-grow-seq) close "testme"
+(extent-grow-seq) open "testme" for verification
+(extent-grow-seq) verified contents of "testme"
+(extent-grow-seq) close "testme"
+(extent-grow-seq) end
+EOF
+pass;
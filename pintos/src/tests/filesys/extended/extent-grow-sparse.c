@@ -0,0 +1,16 @@
+/* Writes a sparse file, on a file system formatted with the extent
+   format, with enough extents to split the root of its extent tree,
+   and checks that the holes read as zeros. */
+
+#include "tests/filesys/extended/extent-sparse.h"
+#include "tests/lib.h"
+#include "tests/main.h"
+
+static char buf[SPARSE_SIZE];
+
+void
+test_main (void)
+{
+  make_sparse ("testfile", buf);
+  check_file ("testfile", buf, sizeof buf);
+}
@@ -0,0 +1,16 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(extent-grow-sparse) begin
+(extent-grow-sparse) create "testfile"
+(extent-grow-sparse) open "testfile"
+(extent-grow-sparse) write every other sector of "testfile"
+(extent-grow-sparse) close "testfile"
+(extent-grow-sparse) open "testfile" for verification
+(extent-grow-sparse) verified contents of "testfile"
+(extent-grow-sparse) close "testfile"
+(extent-grow-sparse) end
+EOF
+pass;
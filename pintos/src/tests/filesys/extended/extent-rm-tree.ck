@@ -0,0 +1,20 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(extent-rm-tree) begin
+(extent-rm-tree) create "sparse"
+(extent-rm-tree) open "sparse"
+(extent-rm-tree) write every other sector of "sparse"
+(extent-rm-tree) close "sparse"
+(extent-rm-tree) creating /0/0/0/0 through /3/2/2/3...
+(extent-rm-tree) open "/0/2/0/3"
+(extent-rm-tree) close "/0/2/0/3"
+(extent-rm-tree) removing /0/0/0/0 through /3/2/2/3...
+(extent-rm-tree) open "/3/0/2/0" (must return -1)
+(extent-rm-tree) remove "sparse"
+(extent-rm-tree) open "sparse" (must return -1)
+(extent-rm-tree) end
+EOF
+pass;
@@ -0,0 +1,31 @@
+/* Writes a sparse file whose holes split it into more extents
+   than the root of an extent tree holds. */
+
+#include "tests/filesys/extended/extent-sparse.h"
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+
+/* Creates FILE_NAME and writes an 'x' at the start of every other
+   sector of it, SPARSE_SIZE bytes in all, leaving the sectors in
+   between as holes.  Stores the expected contents in BUF. */
+void
+make_sparse (const char *file_name, char buf[SPARSE_SIZE])
+{
+  size_t ofs;
+  int fd;
+
+  memset (buf, 0, SPARSE_SIZE);
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  msg ("write every other sector of \"%s\"", file_name);
+  for (ofs = 0; ofs < SPARSE_SIZE; ofs += 2 * 512)
+    {
+      buf[ofs] = 'x';
+      seek (fd, ofs);
+      if (write (fd, buf + ofs, 1) != 1)
+        fail ("write at offset %zu in \"%s\" failed", ofs, file_name);
+    }
+  msg ("close \"%s\"", file_name);
+  close (fd);
+}
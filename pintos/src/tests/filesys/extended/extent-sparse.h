@@ -0,0 +1,9 @@
+#ifndef TESTS_FILESYS_EXTENDED_EXTENT_SPARSE_H
+#define TESTS_FILESYS_EXTENDED_EXTENT_SPARSE_H
+
+/* Size of the file written by make_sparse(). */
+#define SPARSE_SIZE (200 * 512 + 1)
+
+void make_sparse (const char *file_name, char buf[SPARSE_SIZE]);
+
+#endif /* tests/filesys/extended/extent-sparse.h */
@@ -0,0 +1,61 @@
+/* Writes a new file and checks, with cachestat(), that its data
+   reaches the disk when fsync() is called and not before: the
+   kernel is booted with dirty sectors expiring late enough that
+   the write-behind daemon writes nothing back meanwhile.  Then
+   extends the file and checks that fdatasync() leaves the free
+   map, which records the new sector, for fsync() to write back.
+   Also checks that both fail on a closed file. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define DATA_SIZE 8192
+
+static char buf[DATA_SIZE + 512];
+
+/* Returns the number of sectors written back by the buffer cache
+   so far. */
+static unsigned long long
+flush_writes (void)
+{
+  struct cache_stats st;
+
+  if (!cachestat (-1, &st))
+    fail ("cachestat failed");
+  return st.flush_writes;
+}
+
+void
+test_main (void)
+{
+  const char *file_name = "testfile";
+  unsigned long long before;
+  int fd;
+
+  memset (buf, 'f', sizeof buf);
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  before = flush_writes ();
+  CHECK (write (fd, buf, DATA_SIZE) == DATA_SIZE, "write \"%s\"", file_name);
+  if (flush_writes () != before)
+    fail ("data written back before fsync");
+  CHECK (fsync (fd), "fsync \"%s\"", file_name);
+  if (flush_writes () - before < DATA_SIZE / 512)
+    fail ("only %llu sectors written back by fsync",
+          flush_writes () - before);
+
+  CHECK (write (fd, buf + DATA_SIZE, 512) == 512, "extend \"%s\"", file_name);
+  CHECK (fdatasync (fd), "fdatasync \"%s\"", file_name);
+  before = flush_writes ();
+  CHECK (fsync (fd), "fsync \"%s\" again", file_name);
+  if (flush_writes () == before)
+    fail ("fdatasync wrote the free map back");
+  msg ("close \"%s\"", file_name);
+  close (fd);
+  CHECK (!fsync (fd), "fsync closed file (must fail)");
+  CHECK (!fdatasync (fd), "fdatasync closed file (must fail)");
+
+  check_file (file_name, buf, sizeof buf);
+}
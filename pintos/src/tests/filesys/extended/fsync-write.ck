@@ -0,0 +1,22 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(fsync-write) begin
+(fsync-write) create "testfile"
+(fsync-write) open "testfile"
+(fsync-write) write "testfile"
+(fsync-write) fsync "testfile"
+(fsync-write) extend "testfile"
+(fsync-write) fdatasync "testfile"
+(fsync-write) fsync "testfile" again
+(fsync-write) close "testfile"
+(fsync-write) fsync closed file (must fail)
+(fsync-write) fdatasync closed file (must fail)
+(fsync-write) open "testfile" for verification
+(fsync-write) verified contents of "testfile"
+(fsync-write) close "testfile"
+(fsync-write) end
+EOF
+pass;
@@ -36,6 +36,8 @@
 #include "devices/ide.h"
 #include "filesys/filesys.h"
 #include "filesys/fsutil.h"
+#include "filesys/cache.h"
+#include "filesys/inode.h"
 #endif
 
 /* Page directory with kernel mappings only. */
@@ -243,10 +245,25 @@ parse_options (char **argv)
 #ifdef FILESYS
       else if (!strcmp (name, "-f"))
         format_filesys = true;
+      else if (!strcmp (name, "-extents"))
+        inode_set_format (INODE_EXTENTS);
       else if (!strcmp (name, "-filesys"))
         filesys_bdev_name = value;
       else if (!strcmp (name, "-scratch"))
         scratch_bdev_name = value;
+      else if (!strcmp (name, "-cache"))
+        cache_set_size (atoi (value));
+      else if (!strcmp (name, "-dirty-expire"))
+        cache_set_dirty_expire ((int64_t) atoi (value) * TIMER_FREQ / 1000);
+      else if (!strcmp (name, "-dirty-ratio"))
+        cache_set_dirty_ratio (atoi (value));
+      else if (!strcmp (name, "-cache-meta"))
+        cache_set_meta_reserve (atoi (value));
+      else if (!strcmp (name, "-cache-policy"))
+        {
+          if (!cache_set_policy (value))
+            PANIC ("unknown cache policy `%s'", value);
+        }
 #ifdef VM
       else if (!strcmp (name, "-swap"))
         swap_bdev_name = value;
@@ -371,8 +388,14 @@ usage (void)
           "  -r                 Reboot after actions.\n"
 #ifdef FILESYS
           "  -f                 Format file system device during startup.\n"
+          "  -extents           With -f, map files with extents, not pointers.\n"
           "  -filesys=BDEV      Use BDEV for file system instead of default.\n"
           "  -scratch=BDEV      Use BDEV for scratch instead of default.\n"
+          "  -cache=N           Start with a buffer cache of N sectors.\n"
+          "  -dirty-expire=MS   Write back cached data dirty for MS ms.\n"
+          "  -dirty-ratio=PCT   Throttle writers past PCT%% dirty cache.\n"
+          "  -cache-meta=PCT    Reserve PCT%% of the buffer cache for metadata.\n"
+          "  -cache-policy=P    Replace cached sectors by P: clock, lru, 2q.\n"
 #ifdef VM
           "  -swap=BDEV         Use BDEV for swap instead of default.\n"
 #endif
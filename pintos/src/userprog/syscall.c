@@ -17,6 +17,7 @@
 #include <filesys/filesys.h>
 #include <filesys/file.h>
 #include <filesys/inode.h>
+#include <filesys/cache.h>
 
 #define MAX_ARGS 3
 
@@ -133,6 +134,26 @@ syscall_handler (struct intr_frame *f)
         get_arguments (sp, &args[0], 2);
         f->eax = readdir ((int)args[0], (char *)args[1]);
 	break; 
+
+    case SYS_CACHESTAT:
+        get_arguments (sp, &args[0], 2);
+        f->eax = cachestat ((int)args[0], (struct cache_stats *)args[1]);
+        break;
+
+    case SYS_FSYNC:
+        get_arguments (sp, &args[0], 1);
+        f->eax = fsync ((int)args[0]);
+        break;
+
+    case SYS_FDATASYNC:
+        get_arguments (sp, &args[0], 1);
+        f->eax = fdatasync ((int)args[0]);
+        break;
+
+    case SYS_DIRECTIO:
+        get_arguments (sp, &args[0], 2);
+        f->eax = directio ((int)args[0], (bool)args[1]);
+        break;
   }
 }
 
@@ -402,3 +423,60 @@ inumber (int fd)
   struct inode *inode = file_get_inode (t->fd[fd]);
   return inode_get_inumber (inode);
 }
+
+/* Copies the buffer cache statistics to STATS.  If FD is an open
+   file, not a directory, also reports its read-ahead window. */
+bool
+cachestat (int fd, struct cache_stats *stats)
+{
+  struct thread *t = thread_current ();
+
+  validate_pointer (stats);
+  validate_pointer ((char *)(stats + 1) - 1);
+  cache_get_stats (stats);
+  if (fd >= 2 && fd < MAX_FD && t->fd[fd] != NULL
+      && !inode_is_directory (file_get_inode (t->fd[fd])))
+    stats->read_ahead_window = file_read_ahead_window (t->fd[fd]);
+  return true;
+}
+
+/* Writes the cached data of file FD, and the free map recording
+   its sectors, to disk.  Returns false if FD is not open. */
+bool
+fsync (int fd)
+{
+  struct thread *t = thread_current ();
+
+  if (fd < 2 || fd >= MAX_FD || t->fd[fd] == NULL)
+    return false;
+  inode_sync (file_get_inode (t->fd[fd]), true);
+  return true;
+}
+
+/* Writes the cached data of file FD to disk.  Returns false if FD
+   is not open. */
+bool
+fdatasync (int fd)
+{
+  struct thread *t = thread_current ();
+
+  if (fd < 2 || fd >= MAX_FD || t->fd[fd] == NULL)
+    return false;
+  inode_sync (file_get_inode (t->fd[fd]), false);
+  return true;
+}
+
+/* Makes reads and writes of whole sectors of file FD bypass the
+   buffer cache if ENABLE is true, or go through it again if false.
+   Returns false if FD is not an open file. */
+bool
+directio (int fd, bool enable)
+{
+  struct thread *t = thread_current ();
+
+  if (fd < 2 || fd >= MAX_FD || t->fd[fd] == NULL
+      || inode_is_directory (file_get_inode (t->fd[fd])))
+    return false;
+  file_set_direct (t->fd[fd], enable);
+  return true;
+}